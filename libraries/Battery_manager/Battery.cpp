@@ -33,13 +33,269 @@ namespace plugin
 
 #define DEBUG_LOG_BATTERY_MANAGER   0
 
+#define BATTERY_FILTER_SAMPLES      8      // Same as the size of the arrays in LevelFilter.
+#define BATTERY_HYSTERESIS_MV       20     // Change of the averaged voltage needed to move the level.
+#define BATTERY_HYSTERESIS_LEVEL    3      // Same, in percent, for the sides that do not send the voltage.
+#define BATTERY_NOTIFY_MIN_MS       60000  // Minimum time between two BLE battery notifications.
+#define BATTERY_NOTIFY_LOW_LEVEL    10     // Below this level the changes are notified without waiting.
+#define BATTERY_NOT_NOTIFIED        0xFF
+
+#define BATTERY_HISTORY_FINE_S      60     // Period of the fine history ring.
+#define BATTERY_HISTORY_COARSE_S    1800   // Period of the coarse history ring.
+#define BATTERY_ETA_MIN_SPAN_S      1200   // Discharge needed before estimating the rate.
+#define BATTERY_ETA_MIN_SAMPLES     3
+
 uint8_t Battery::battery_level;
 uint8_t Battery::saving_mode;
+bool Battery::governor_saving = false;
 uint16_t Battery::settings_saving_;
 uint8_t Battery::status_left = 4;
 uint8_t Battery::status_right = 4;
 uint8_t Battery::battery_level_left = 100;
 uint8_t Battery::battery_level_right = 100;
+Battery::LevelFilter Battery::filter_left;
+Battery::LevelFilter Battery::filter_right;
+Battery::History Battery::history_left;
+Battery::History Battery::history_right;
+uint8_t Battery::notified_level = BATTERY_NOT_NOTIFIED;
+uint32_t Battery::ti_notified;
+
+uint8_t Battery::getBatteryLevel()
+{
+    return min(battery_level_left, battery_level_right);
+}
+
+bool Battery::isSavingMode()
+{
+    return saving_mode != 0;
+}
+
+uint8_t Battery::sidesSavingMode()
+{
+    return (saving_mode != 0 || governor_saving) ? 1 : 0;
+}
+
+void Battery::setGovernorSaving(bool saving)
+{
+    if (saving == governor_saving) return;
+    governor_saving = saving;
+
+    Communications_protocol::Packet p{};
+    p.header.command = Communications_protocol::BATTERY_SAVING;
+    p.header.size = 1;
+    p.data[0] = sidesSavingMode();
+    Communications.sendPacket(p);
+}
+
+void Battery::filterReset(LevelFilter &filter)
+{
+    filter.count = 0;
+    filter.next = 0;
+}
+
+void Battery::filterUpdate(LevelFilter &filter, uint8_t &battery_level_side, uint8_t level, uint16_t mv)
+{
+    filter.mv[filter.next] = mv;
+    filter.level[filter.next] = level;
+    filter.next = (filter.next + 1) % BATTERY_FILTER_SAMPLES;
+    if (filter.count < BATTERY_FILTER_SAMPLES)
+    {
+        filter.count++;
+    }
+
+    uint32_t sum_mv = 0;
+    uint16_t sum_level = 0;
+    for (uint8_t i = 0; i < filter.count; i++)
+    {
+        sum_mv += filter.mv[i];
+        sum_level += filter.level[i];
+    }
+    uint16_t avg_mv = sum_mv / filter.count;
+    uint8_t avg_level = (sum_level + filter.count / 2) / filter.count;
+
+    // The first sample after a reset is taken as it is.
+    if (filter.count == 1)
+    {
+        filter.accepted_mv = avg_mv;
+        battery_level_side = avg_level;
+        return;
+    }
+
+    bool moved;
+    if (mv != 0)
+    {
+        moved = abs(static_cast<int32_t>(avg_mv) - static_cast<int32_t>(filter.accepted_mv)) >= BATTERY_HYSTERESIS_MV;
+    }
+    else
+    {
+        moved = abs(static_cast<int16_t>(avg_level) - static_cast<int16_t>(battery_level_side)) >= BATTERY_HYSTERESIS_LEVEL;
+    }
+
+    if (moved)
+    {
+        filter.accepted_mv = avg_mv;
+        battery_level_side = avg_level;
+    }
+}
+
+void Battery::notifyLevel(bool force)
+{
+    uint8_t level = getBatteryLevel();
+    if (level == notified_level)
+    {
+        return;
+    }
+
+    bool urgent = level < BATTERY_NOTIFY_LOW_LEVEL || notified_level == BATTERY_NOT_NOTIFIED;
+    if (!force && !urgent && !Runtime.hasTimeExpired(ti_notified, static_cast<uint32_t>(BATTERY_NOTIFY_MIN_MS)))
+    {
+        return;  // beforeEachCycle() sends it when the time is up.
+    }
+
+    ble_battery_level_update(level);
+    notified_level = level;
+    ti_notified = Runtime.millisAtCycleStart();
+}
+
+void Battery::historyRecord(History &history, uint8_t level, uint16_t mv, uint8_t status)
+{
+    HistorySample sample = {millis() / 1000, mv, level, status};
+
+    bool status_changed = false;
+    uint32_t last_fine_s = 0;
+    if (history.fine_count != 0)
+    {
+        HistorySample const &last = history.fine[(history.fine_next + 16 - 1) % 16];
+        status_changed = (last.status != status);
+        last_fine_s = last.time_s;
+    }
+
+    if (history.fine_count == 0 || status_changed || sample.time_s - last_fine_s >= BATTERY_HISTORY_FINE_S)
+    {
+        history.fine[history.fine_next] = sample;
+        history.fine_next = (history.fine_next + 1) % 16;
+        if (history.fine_count < 16) history.fine_count++;
+    }
+
+    uint32_t last_coarse_s = history.coarse[(history.coarse_next + 48 - 1) % 48].time_s;
+    if (history.coarse_count == 0 || status_changed || sample.time_s - last_coarse_s >= BATTERY_HISTORY_COARSE_S)
+    {
+        history.coarse[history.coarse_next] = sample;
+        history.coarse_next = (history.coarse_next + 1) % 48;
+        if (history.coarse_count < 48) history.coarse_count++;
+    }
+}
+
+// The history is made of the coarse samples older than the fine ring, then the fine ring.
+uint8_t Battery::historyOlderCoarse(History const &history)
+{
+    uint8_t coarse_first = (history.coarse_next + 48 - history.coarse_count) % 48;
+    uint8_t fine_first = (history.fine_next + 16 - history.fine_count) % 16;
+
+    uint8_t older = 0;
+    while (older < history.coarse_count && history.coarse[(coarse_first + older) % 48].time_s < history.fine[fine_first].time_s)
+    {
+        older++;
+    }
+    return older;
+}
+
+uint8_t Battery::historyCount(History const &history)
+{
+    return historyOlderCoarse(history) + history.fine_count;
+}
+
+Battery::HistorySample const &Battery::historyAt(History const &history, uint8_t index)
+{
+    uint8_t coarse_first = (history.coarse_next + 48 - history.coarse_count) % 48;
+    uint8_t fine_first = (history.fine_next + 16 - history.fine_count) % 16;
+    uint8_t older = historyOlderCoarse(history);
+
+    if (index < older)
+    {
+        return history.coarse[(coarse_first + index) % 48];
+    }
+    return history.fine[(fine_first + index - older) % 16];
+}
+
+/*
+    Least squares slope of the level over the samples since the side was last on the charger.
+    Returns false while the discharge is too short to say anything.
+*/
+bool Battery::historyRate(History const &history, float &percent_per_hour)
+{
+    uint8_t count = historyCount(history);
+    uint8_t first = count;
+    while (first > 0 && historyAt(history, first - 1).status == NOT_CHARGING)
+    {
+        first--;
+    }
+
+    uint8_t samples = count - first;
+    if (samples < BATTERY_ETA_MIN_SAMPLES)
+    {
+        return false;
+    }
+
+    uint32_t t0 = historyAt(history, first).time_s;
+    if (historyAt(history, count - 1).time_s - t0 < BATTERY_ETA_MIN_SPAN_S)
+    {
+        return false;
+    }
+
+    float sum_t = 0, sum_l = 0, sum_tt = 0, sum_tl = 0;
+    for (uint8_t i = first; i < count; i++)
+    {
+        HistorySample const &sample = historyAt(history, i);
+        float t = (sample.time_s - t0) / 3600.0f;
+        sum_t += t;
+        sum_l += sample.level;
+        sum_tt += t * t;
+        sum_tl += t * sample.level;
+    }
+
+    float den = samples * sum_tt - sum_t * sum_t;
+    if (den <= 0)
+    {
+        return false;
+    }
+
+    percent_per_hour = -(samples * sum_tl - sum_t * sum_l) / den;
+    return percent_per_hour > 0;
+}
+
+// Per sample, oldest first: seconds ago, mV, level and charger status.
+void Battery::sendHistory(History const &history)
+{
+    uint32_t now_s = millis() / 1000;
+    uint8_t count = historyCount(history);
+    for (uint8_t i = 0; i < count; i++)
+    {
+        HistorySample const &sample = historyAt(history, i);
+        ::Focus.send(now_s - sample.time_s, sample.mv, sample.level, sample.status);
+    }
+}
+
+// Discharge rate in hundredths of percent per hour and minutes left, both 0 while unknown or charging.
+void Battery::sendEta(History const &history, uint8_t level, uint8_t status)
+{
+    float percent_per_hour;
+    if (status != NOT_CHARGING || !historyRate(history, percent_per_hour))
+    {
+        ::Focus.send(0, 0);
+        return;
+    }
+
+    uint32_t minutes = static_cast<uint32_t>(level * 60.0f / percent_per_hour);
+    ::Focus.send(static_cast<uint32_t>(percent_per_hour * 100), minutes);
+}
+
+EventHandlerResult Battery::beforeEachCycle()
+{
+    notifyLevel(false);
+
+    return EventHandlerResult::OK;
+}
 
 EventHandlerResult Battery::onKeyswitchEvent(Key &mappedKey, KeyAddr key_addr, uint8_t keyState)
 {
@@ -69,7 +325,8 @@ EventHandlerResult Battery::onFocusEvent(const char *command)
 {
     if (::Focus.handleHelp(
             command,
-            "wireless.battery.left.level\nwireless.battery.right.level\nwireless.battery.left.status\nwireless.battery.right.status\nwireless.battery.savingMode"))
+            "wireless.battery.left.level\nwireless.battery.right.level\nwireless.battery.left.status\nwireless.battery.right.status\nwireless.battery.savingMode\n"
+            "wireless.battery.left.history\nwireless.battery.right.history\nwireless.battery.left.eta\nwireless.battery.right.eta"))
         return EventHandlerResult::OK;
 
     if (strncmp(command, "wireless.battery.", 17) != 0) return EventHandlerResult::OK;
@@ -121,6 +378,38 @@ EventHandlerResult Battery::onFocusEvent(const char *command)
         }
     }
 
+    if (strcmp(command + 17, "left.history") == 0)
+    {
+        if (::Focus.isEOL())
+        {
+            sendHistory(history_left);
+        }
+    }
+
+    if (strcmp(command + 17, "right.history") == 0)
+    {
+        if (::Focus.isEOL())
+        {
+            sendHistory(history_right);
+        }
+    }
+
+    if (strcmp(command + 17, "left.eta") == 0)
+    {
+        if (::Focus.isEOL())
+        {
+            sendEta(history_left, battery_level_left, status_left);
+        }
+    }
+
+    if (strcmp(command + 17, "right.eta") == 0)
+    {
+        if (::Focus.isEOL())
+        {
+            sendEta(history_right, battery_level_right, status_right);
+        }
+    }
+
     if (strcmp(command + 17, "savingMode") == 0)
     {
         if (::Focus.isEOL())
@@ -139,7 +428,7 @@ EventHandlerResult Battery::onFocusEvent(const char *command)
             Communications_protocol::Packet p{};
             p.header.command = Communications_protocol::BATTERY_SAVING;
             p.header.size = 1;
-            p.data[0] = saving_mode;
+            p.data[0] = sidesSavingMode();
             Communications.sendPacket(p);
             Runtime.storage().put(settings_saving_, saving_mode);
             Runtime.storage().commit();
@@ -182,12 +471,15 @@ EventHandlerResult Battery::onSetup()
     Communications.callbacks.bind(BATTERY_STATUS, (
                                                       [this](Packet const &packet)
                                                       {
+                                                          // Plugging or unplugging the charger steps the voltage, start the average again.
                                                           if (filterHand(packet.header.device, false))
                                                           {
+                                                              if (status_left != packet.data[0]) filterReset(filter_left);
                                                               status_left = packet.data[0];
                                                           }
                                                           if (filterHand(packet.header.device, true))
                                                           {
+                                                              if (status_right != packet.data[0]) filterReset(filter_right);
                                                               status_right = packet.data[0];
                                                           }
 
@@ -199,17 +491,19 @@ EventHandlerResult Battery::onSetup()
     Communications.callbacks.bind(BATTERY_LEVEL, (
                                                      [this](Packet const &packet)
                                                      {
+                                                         uint16_t battery_level_mv;
+                                                         memcpy(&battery_level_mv, &packet.data[1], sizeof(battery_level_mv));
                                                          if (filterHand(packet.header.device, false))
                                                          {
-                                                             battery_level_left = packet.data[0];
+                                                             filterUpdate(filter_left, battery_level_left, packet.data[0], battery_level_mv);
+                                                             historyRecord(history_left, battery_level_left, filter_left.accepted_mv, status_left);
                                                          }
                                                          if (filterHand(packet.header.device, true))
                                                          {
-                                                             battery_level_right = packet.data[0];
+                                                             filterUpdate(filter_right, battery_level_right, packet.data[0], battery_level_mv);
+                                                             historyRecord(history_right, battery_level_right, filter_right.accepted_mv, status_right);
                                                          }
-                                                         uint16_t battery_level_mv;
-                                                         memcpy(&battery_level_mv, &packet.data[1], sizeof(battery_level_mv));
-                                                         ble_battery_level_update(min(battery_level_left, battery_level_right));
+                                                         notifyLevel(false);
 #if DEBUG_LOG_BATTERY_MANAGER
                                                          NRF_LOG_DEBUG("Battery level: %i device %i percentage %i mv",
                                                                        packet.header.device,
@@ -225,13 +519,17 @@ EventHandlerResult Battery::onSetup()
                                                         {
                                                             battery_level_left = 100;
                                                             status_left = 4;
+                                                            filterReset(filter_left);
+                                                            historyRecord(history_left, 0, 0, status_left);
                                                         }
                                                         if (filterHand(packet.header.device, true))
                                                         {
                                                             battery_level_right = 100;
                                                             status_right = 4;
+                                                            filterReset(filter_right);
+                                                            historyRecord(history_right, 0, 0, status_right);
                                                         }
-                                                        ble_battery_level_update(min(battery_level_left, battery_level_right));
+                                                        notifyLevel(true);
                                                     }));
 
     Communications.callbacks.bind(CONNECTED, (
@@ -239,7 +537,7 @@ EventHandlerResult Battery::onSetup()
                                                  {
                                                      packet.header.command = BATTERY_SAVING;
                                                      packet.header.size = 1;
-                                                     packet.data[0] = saving_mode;
+                                                     packet.data[0] = sidesSavingMode();
                                                      Communications.sendPacket(packet);
                                                  }));
     return EventHandlerResult::OK;
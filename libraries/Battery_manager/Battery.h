@@ -29,17 +29,83 @@ namespace plugin {
 class Battery : public Plugin {
    public:
     EventHandlerResult onSetup();
+    EventHandlerResult beforeEachCycle();
     EventHandlerResult onFocusEvent(const char *command);
     EventHandlerResult onKeyswitchEvent(Key &mapped_Key, KeyAddr key_addr, uint8_t key_state);
 
+    // Level of the side with the lowest battery, in percent.
+    static uint8_t getBatteryLevel();
+    static uint8_t getBatteryLevelLeft() { return battery_level_left; }
+    static uint8_t getBatteryLevelRight() { return battery_level_right; }
+    static uint8_t getStatusLeft() { return status_left; }
+    static uint8_t getStatusRight() { return status_right; }
+    static bool isSavingMode();
+
+    // The sides are also put in saving mode while the PowerGovernor asks for it, without touching the setting.
+    static void setGovernorSaving(bool saving);
+
    private:
+    // Moving average of the last samples of a side, the level only follows it past a hysteresis.
+    struct LevelFilter
+    {
+        uint16_t mv[8];
+        uint8_t level[8];
+        uint8_t count;
+        uint8_t next;
+        uint16_t accepted_mv;
+    };
+
+    /*
+        History of the filtered values of a side: a fine ring with one sample per minute, and a
+        coarse ring with one sample every 30 minutes that covers the last day. A charger status
+        change is always recorded, and so is a disconnection of the side, as a sample with status 4
+        and no level, so a discharge is never fitted across the time the side was away.
+        RAM cost: 2 sides x 64 samples x 8 bytes = 1 KB.
+    */
+    struct HistorySample
+    {
+        uint32_t time_s;  // Since boot.
+        uint16_t mv;
+        uint8_t level;
+        uint8_t status;
+    };
+    struct History
+    {
+        HistorySample fine[16];
+        HistorySample coarse[48];
+        uint8_t fine_count;
+        uint8_t fine_next;
+        uint8_t coarse_count;
+        uint8_t coarse_next;
+    };
+
     static uint8_t battery_level;
     static uint8_t saving_mode;
+    static bool governor_saving;
     static uint16_t settings_saving_;
     static uint8_t status_left;
     static uint8_t status_right;
     static uint8_t battery_level_left;
     static uint8_t battery_level_right;
+    static LevelFilter filter_left;
+    static LevelFilter filter_right;
+    static History history_left;
+    static History history_right;
+    static uint8_t notified_level;
+    static uint32_t ti_notified;
+
+    static void filterReset(LevelFilter &filter);
+    static void filterUpdate(LevelFilter &filter, uint8_t &battery_level_side, uint8_t level, uint16_t mv);
+    static void notifyLevel(bool force);
+    static uint8_t sidesSavingMode();
+
+    static void historyRecord(History &history, uint8_t level, uint16_t mv, uint8_t status);
+    static uint8_t historyOlderCoarse(History const &history);
+    static uint8_t historyCount(History const &history);
+    static HistorySample const &historyAt(History const &history, uint8_t index);  // Oldest first.
+    static bool historyRate(History const &history, float &percent_per_hour);
+    static void sendHistory(History const &history);
+    static void sendEta(History const &history, uint8_t level, uint8_t status);
 };
 
 }  // namespace plugin
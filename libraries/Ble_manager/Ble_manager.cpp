@@ -20,6 +20,7 @@
 
 #include "Ble_manager.h"
 
+#include "Battery.h"
 #include "Ble_composite_dev.h"
 #include "Communications.h"
 #include "Kaleidoscope-FocusSerial.h"
@@ -27,8 +28,64 @@
 #include "cstdio"
 #include "kaleidoscope/key_events.h"
 #include "kaleidoscope/plugin/LEDControlDefy.h"
+#include "HID-Settings.h"
+#include "HIDReportObserver.h"
+#include "MultiReport/RawHID.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "app_util.h"
+#include "app_util_platform.h"
+#include "ble_conn_params.h"
+#include "nrf_sdh_ble.h"
+#include "nrf_soc.h"
+#include "peer_manager.h"
+
+#ifdef __cplusplus
+}
+#endif
 
 void device_name_evt_handler(void);
+static void ble_manager_evt_handler(ble_evt_t const *p_ble_evt, void *p_context);
+static void ble_manager_report_sent_hook(uint8_t id, int len, bool ble, bool success, uint32_t latency_us);
+
+#define BLE_MANAGER_OBSERVER_PRIO   3
+
+// Connection parameters in 1.25ms units, supervision timeout in 10ms units.
+#define CONN_ACTIVE_MIN_INTERVAL    MSEC_TO_UNITS(7.5, UNIT_1_25_MS)
+#define CONN_ACTIVE_MAX_INTERVAL    MSEC_TO_UNITS(15, UNIT_1_25_MS)
+#define CONN_ACTIVE_SLAVE_LATENCY   0
+#define CONN_IDLE_MIN_INTERVAL      MSEC_TO_UNITS(45, UNIT_1_25_MS)
+#define CONN_IDLE_MAX_INTERVAL      MSEC_TO_UNITS(60, UNIT_1_25_MS)
+#define CONN_IDLE_SLAVE_LATENCY     20
+#define CONN_SUP_TIMEOUT            MSEC_TO_UNITS(4000, UNIT_10_MS)
+#define CONN_PARAMS_RETRY_MS        5000  // Wait between requests, in case the host does not grant them.
+
+#define BULK_TRANSFER_END_MS        1000  // RawHID quiet time that ends a bulk transfer.
+#define BLE_THROUGHPUT_DATA_LENGTH  251   // Data length requested during a bulk transfer, the longest one.
+
+// Advertising policy.
+#define ADV_FAST_BONDED_MS          10000   // Directed, then whitelisted, to the known host.
+#define ADV_FAST_PAIRING_MS         30000   // Open advertising, waiting for the user to pair.
+#define ADV_TOTAL_BONDED_MS         120000
+#define ADV_TOTAL_PAIRING_MS        180000
+#define ADV_SLOW_WINDOW_MS          2000
+#define ADV_SLOW_PAUSE_MIN_MS       5000
+#define ADV_SLOW_PAUSE_MAX_MS       60000
+#define ADV_BATTERY_LOW             20      // %, shorter advertising.
+#define ADV_BATTERY_CRITICAL        10      // %, only the fast burst.
+#define ADV_DIRECTED_SET_HANDLE     0       // The S140 has a single advertising set, created by the advertising module.
+#ifndef APP_BLE_CONN_CFG_TAG
+#define APP_BLE_CONN_CFG_TAG        1       // Link configuration set by ble_module_init().
+#endif
+
+// Time between the radio notification and the radio event, it has to cover a key processing pass.
+#define ANCHOR_NOTIFICATION_DISTANCE    NRF_RADIO_NOTIFICATION_DISTANCE_2680US
+
+NRF_SDH_BLE_OBSERVER(ble_manager_observer, BLE_MANAGER_OBSERVER_PRIO, ble_manager_evt_handler, NULL);
 
 namespace kaleidoscope
 {
@@ -118,6 +175,8 @@ void BleManager::init(void)
 EventHandlerResult BleManager::onSetup(void)
 {
     flash_base_addr = kaleidoscope::plugin::EEPROMSettings::requestSlice(sizeof(ble_flash_data));
+    // Channel, bonds and forceBle are saved right before reset_mcu(), so they must survive it.
+    EEPROM.markCritical(flash_base_addr, sizeof(ble_flash_data));
 
     Runtime.storage().get(flash_base_addr, ble_flash_data);
     // For now lest think that if this variable is invalid, restart everything.
@@ -167,12 +226,49 @@ EventHandlerResult BleManager::onSetup(void)
     ledBluetoothPairingDefy.setConnectedChannel(NOT_CONNECTED);
     ledBluetoothPairingDefy.setEreaseDone(false);
 
+    HIDReportObserver::resetSentHook(ble_manager_report_sent_hook);
+
 #if BLE_MANAGER_DEBUG_LOG
     NRF_LOG_FLUSH();
 #endif
     return EventHandlerResult::OK;
 }
 
+void BleManager::reserve_settings(void)
+{
+    settings_base_addr = kaleidoscope::plugin::EEPROMSettings::requestSlice(sizeof(ble_settings));
+    Runtime.storage().get(settings_base_addr, ble_settings);
+    if (ble_settings.idle_timeout_ms == 0xFFFF || ble_settings.anchor_sync == 0xFF)
+    {
+        ble_settings.reset();
+
+        // Save it in flash memory.
+        Runtime.storage().put(settings_base_addr, ble_settings);
+        Runtime.storage().commit();
+    }
+
+    ble_settings.idle_timeout_ms = clamp_idle_timeout(ble_settings.idle_timeout_ms);
+}
+
+uint16_t BleManager::clamp_idle_timeout(uint16_t timeout_ms)
+{
+    /*
+        A very short timeout makes the link flap between the active and idle parameters, and
+        0xFFFF is the erased value, which would be restored to the default on the next boot.
+    */
+    if (timeout_ms < BLE_IDLE_TIMEOUT_MS_MIN)
+    {
+        return BLE_IDLE_TIMEOUT_MS_MIN;
+    }
+
+    if (timeout_ms > BLE_IDLE_TIMEOUT_MS_MAX)
+    {
+        return BLE_IDLE_TIMEOUT_MS_MAX;
+    }
+
+    return timeout_ms;
+}
+
 void BleManager::update_channel_and_name(void)
 {
     set_current_channel(ble_flash_data.currentChannel);
@@ -204,6 +300,11 @@ EventHandlerResult BleManager::beforeEachCycle(void)
 
     timer_save_conn_run(2000);  // 2000ms timer.
     timer_save_name_run(2000);  // 2000ms timer.
+    channel_switch_run(500);    // Max 500ms per step.
+    fast_reconnect_run();
+    throughput_run();
+    conn_params_run();
+    anchor_sync_run();
 
     if (get_flag_security_proc_started())
     {
@@ -224,6 +325,12 @@ EventHandlerResult BleManager::beforeEachCycle(void)
         mitm_activated = false;
     }
 
+    // The link states seen in the middle of a channel switch are transitory.
+    if (channel_switch_state != CHANNEL_SWITCH_IDLE)
+    {
+        return EventHandlerResult::OK;
+    }
+
     // Gives time to the EPPROM to update
     static bool activated_advertising = false;
     if (ble_is_advertising_mode())
@@ -256,22 +363,12 @@ EventHandlerResult BleManager::beforeEachCycle(void)
 
         trigger_save_conn_timer = true;
     }
-    else if (activated_advertising && ble_is_idle())
+    else if (activated_advertising && adv_state == ADV_POLICY_STOPPED)
     {
         activated_advertising = false;
-        LEDControl::disable();
-        Communications_protocol::Packet p{};
-        p.header.command = Communications_protocol::SLEEP;
-        Communications.sendPacket(p);
     }
 
-    // Reconection of side
-    if (!activated_advertising && ble_is_idle() && LEDControl::isEnabled())
-    {
-        ble_goto_advertising_mode();
-        ledBluetoothPairingDefy.setAvertisingModeOn(ble_flash_data.currentChannel);
-        send_led_mode();
-    }
+    adv_policy_run();
 
     return EventHandlerResult::OK;
 }
@@ -424,6 +521,11 @@ void BleManager::save_device_name(void)
 
 EventHandlerResult BleManager::onKeyswitchEvent(Key &mappedKey, KeyAddr key_addr, uint8_t keyState)
 {
+    if (keyToggledOn(keyState) || keyToggledOff(keyState))
+    {
+        mark_activity();
+    }
+
     /* Exit conditions. */
     if (!ble_innited())
     {
@@ -497,9 +599,9 @@ EventHandlerResult BleManager::onKeyswitchEvent(Key &mappedKey, KeyAddr key_addr
 
     EventHandlerResult result = EventHandlerResult::OK;
     
-    if (ble_is_idle())
+    if (ble_is_idle() && channel_switch_state == CHANNEL_SWITCH_IDLE)
     {
-        ble_goto_advertising_mode();
+        adv_policy_wake();
         ledBluetoothPairingDefy.setAvertisingModeOn(ble_flash_data.currentChannel);
         send_led_mode();
         LEDControl::enable();
@@ -572,62 +674,9 @@ EventHandlerResult BleManager::onKeyswitchEvent(Key &mappedKey, KeyAddr key_addr
                 // NRF_LOG_DEBUG(" ble_is_advertising_mode(): %i", ble_is_advertising_mode());
                 if (ble_flash_data.currentChannel != index_channel)
                 {
-#if BLE_MANAGER_DEBUG_LOG
-                    NRF_LOG_DEBUG("Ble_manager: Changing channel %i to %i", ble_flash_data.currentChannel, index_channel);
-#endif
-
-                    ble_flash_data.currentChannel = index_channel;
-                    ledBluetoothPairingDefy.setConnectedChannel(NOT_CONNECTED);
-                    ledBluetoothPairingDefy.setAvertisingModeOn(ble_flash_data.currentChannel);
-                    send_led_mode();
-                    update_channel_and_name();
-
-                    // First we disable scanning and advertising.
-                    ble_adv_stop();
-                    delay(200);
-                    
-                    // Save it in flash memory.
-                    Runtime.storage().put(flash_base_addr, ble_flash_data);
-                    Runtime.storage().commit();
-                    /*
-                        In this case, the data need to be saved instantly and not when
-                        run_update_periodically() is executed.
-                    */
-                    EEPROM.update();
-
-                    update_current_channel();
-                    delay(200);
-
-                    // Try to change the channel.
-                    ble_disconnect();
-                    delay(200);
-
-                    // Try to reconnect again.
-                    gap_params_init();
-                    delay(200);
-
-                    ble_adv_stop();
-                    advertising_init();
-                    delay(200);
-
-                    /*
-                        If it doesn't have any device paired on the channel, it goes into
-                        advertising with a whitelist so that any device can find it.
-                    */
-                    pm_peer_id_t active_connection_peer_id = ble_flash_data.ble_connections[ble_flash_data.currentChannel].get_peer_id();
-                    if (active_connection_peer_id == PM_PEER_ID_INVALID)
-                    {
-#if BLE_MANAGER_DEBUG_LOG
-                        NRF_LOG_INFO("Ble_manager: Whitelist deactivated.");
-#endif
-                        ble_goto_advertising_mode();
-                    }
-                    else
+                    if (channel_switch_state == CHANNEL_SWITCH_IDLE)
                     {
-#if BLE_MANAGER_DEBUG_LOG
-                        NRF_LOG_INFO("Ble_manager: Whitelist activated.");
-#endif
-                        ble_goto_white_list_advertising_mode();
+                        start_channel_switch(index_channel);
                     }
 
                     result = EventHandlerResult::EVENT_CONSUMED;
@@ -647,204 +696,983 @@ EventHandlerResult BleManager::onKeyswitchEvent(Key &mappedKey, KeyAddr key_addr
     return result;
 }
 
-bool BleManager::is_num_key(uint16_t raw_key)
+void BleManager::start_channel_switch(uint8_t new_channel)
 {
+#if BLE_MANAGER_DEBUG_LOG
+    NRF_LOG_DEBUG("Ble_manager: Changing channel %i to %i", ble_flash_data.currentChannel, new_channel);
+#endif
+
+    ble_flash_data.currentChannel = new_channel;
+    ledBluetoothPairingDefy.setConnectedChannel(NOT_CONNECTED);
+    ledBluetoothPairingDefy.setAvertisingModeOn(ble_flash_data.currentChannel);
+    send_led_mode();
+    update_channel_and_name();
+
     /*
-        #define HID_KEYBOARD_1_AND_EXCLAMATION_POINT	0x1E	// Sel
-        #define HID_KEYBOARD_2_AND_AT			0x1F	// Sel
-        #define HID_KEYBOARD_3_AND_POUND		0x20	// Sel
-        #define HID_KEYBOARD_4_AND_DOLLAR		0x21	// Sel
-        #define HID_KEYBOARD_5_AND_PERCENT		0x22	// Sel
-        #define HID_KEYBOARD_6_AND_CARAT		0x23	// Sel
-        #define HID_KEYBOARD_7_AND_AMPERSAND		0x24	// Sel
-        #define HID_KEYBOARD_8_AND_ASTERISK		0x25	// Sel
-        #define HID_KEYBOARD_9_AND_LEFT_PAREN		0x26	// Sel
-        #define HID_KEYBOARD_0_AND_RIGHT_PAREN		0x27	// Sel
+        The new channel is written to flash by the periodic update. It is a critical slice, so
+        a reset before that is covered by the emergency journal.
     */
-    if ((raw_key >= HID_KEYBOARD_1_AND_EXCLAMATION_POINT) && (raw_key <= HID_KEYBOARD_0_AND_RIGHT_PAREN))
-    {
-        return true;
-    }
+    Runtime.storage().put(flash_base_addr, ble_flash_data);
+    Runtime.storage().commit();
 
-    return false;
+    // First we disable scanning and advertising.
+    ble_adv_stop();
+
+    ti_channel_switch_start = Runtime.millisAtCycleStart();
+    ti_channel_switch_step = ti_channel_switch_start;
+    channel_switch_state = CHANNEL_SWITCH_WAIT_ADV_STOPPED;
 }
 
-char BleManager::raw_key_to_ascii(uint16_t raw_key)
+void BleManager::channel_switch_run(uint32_t step_timeout_ms)
 {
-    uint8_t num = raw_key - HID_KEYBOARD_1_AND_EXCLAMATION_POINT + 1;
+    bool step_timeout = Runtime.hasTimeExpired(ti_channel_switch_step, step_timeout_ms);
 
-    if (num != 10)
-    {
-        return (num + '0'); // To ASCII num.
-    }
-    else
+    switch (channel_switch_state)
     {
-        return '0';
-    }
-}
+        case CHANNEL_SWITCH_IDLE:
+        {
+        }
+        break;
 
-void BleManager::erase_paired_device(uint8_t index_channel)
-{
-    if (ble_flash_data.ble_connections[index_channel].get_peer_id() != PM_PEER_ID_INVALID)
-    {
-#if BLE_MANAGER_DEBUG_LOG
-        NRF_LOG_DEBUG("Ble_manager: Deleting paired device on channel %i...", index_channel);
-        NRF_LOG_FLUSH();
-#endif
+        case CHANNEL_SWITCH_WAIT_ADV_STOPPED:
+        {
+            if (ble_is_advertising_mode() && !step_timeout)
+            {
+                break;
+            }
 
-        connectionState[index_channel].timePressed = 0;
-        connectionState[index_channel].longPress = true;
-        uint8_t peerCount = pm_peer_count();
-        pm_peer_id_t peer_list[peerCount];
-        uint32_t list_size = peerCount;
-        pm_peer_id_list(peer_list, &list_size, PM_PEER_ID_INVALID, PM_PEER_ID_LIST_ALL_ID);
+            update_current_channel();
 
-        for (uint8_t i = 0; i < peerCount; ++i)
+            channel_switch_disconnect();
+            channel_switch_retries = 0;
+
+            ti_channel_switch_step = Runtime.millisAtCycleStart();
+            channel_switch_state = CHANNEL_SWITCH_WAIT_DISCONNECTED;
+        }
+        break;
+
+        case CHANNEL_SWITCH_WAIT_DISCONNECTED:
         {
-            if (peer_list[i] != PM_PEER_ID_INVALID && peer_list[i] == ble_flash_data.ble_connections[index_channel].get_peer_id())
+            bool disconnected = !ble_connected();
+            if (!disconnected && !step_timeout)
             {
-                delete_peer_by_id(ble_flash_data.ble_connections[index_channel].get_peer_id());
+                break;
             }
-        }
 
-        ble_flash_data.ble_connections[index_channel].reset();
-        set_paired_channel_led(index_channel, false); // set channel related bit to 0
+            if (!disconnected)
+            {
+                // The old link is still up, so advertising now would expose the new channel next to it.
+                if (channel_switch_retries < CHANNEL_SWITCH_DISCONNECT_RETRIES)
+                {
+                    channel_switch_retries++;
+                    channel_switch_disconnect();
+                    ti_channel_switch_step = Runtime.millisAtCycleStart();
+                    break;
+                }
 
-        // Save it in flash memory.
-        Runtime.storage().put(flash_base_addr, ble_flash_data);
-        Runtime.storage().commit();
+                NRF_LOG_ERROR("Ble_manager: Channel switch failed, the previous link did not disconnect.");
+                channel_switch_restore();
+                channel_switch_state = CHANNEL_SWITCH_IDLE;
+                break;
+            }
 
-        if (index_channel == ble_flash_data.currentChannel)
-        {
-            ledBluetoothPairingDefy.setConnectedChannel(NOT_CONNECTED);
-            ble_disconnect();
-            // We could remove this reset but a weird led effect happends when the channel is the same
-            reset_mcu();
-        }
+            // Try to reconnect again.
+            gap_params_init();
 
-        ledBluetoothPairingDefy.setEreaseDone(true);
-        send_led_mode(); // this is to update the led effect.
-        ledBluetoothPairingDefy.setEreaseDone(false);
-    }
-}
+            ble_adv_stop();
+            advertising_init();
+
+            adv_session_start();
+            channel_switch_state = CHANNEL_SWITCH_IDLE;
 
-void BleManager::exit_pairing_mode(void)
-{
 #if BLE_MANAGER_DEBUG_LOG
-    NRF_LOG_DEBUG("Ble_manager: Exit pairing mode.");
-    NRF_LOG_FLUSH();
+            NRF_LOG_DEBUG("Ble_manager: Channel switched in %lu ms.", Runtime.millisAtCycleStart() - ti_channel_switch_start);
 #endif
-
-    show_bt_layer = false;
-    ColormapEffectDefy::updateBrigthness(ColormapEffectDefy::LedBrightnessControlEffect::BT_LED_EFFECT,
-                                         false,
-                                         true);
-    ::LEDControl.set_force_mode(false);
-    ::LEDControl.set_mode(0); // Disable LED fade effect.
+        }
+        break;
+    }
 }
 
-void BleManager::set_paired_channel_led(uint8_t channel, bool turnOn)
+void BleManager::channel_switch_disconnect(void)
 {
-    uint8_t bitPosition = channel; // Posición del bit que quieres establecer en 1 (empezando desde 0)
-    if (turnOn)
+    if (ble_connected())
     {
-        channels |= (1 << bitPosition); // Establece el bit en la channel 3 en 1
+        ble_disconnect();
     }
-    else
+}
+
+void BleManager::channel_switch_restore(void)
+{
+    // The keyboard goes back to the channel of the link that is still up, as if the switch was never asked.
+    if (conn_channel >= BLE_CONNECTIONS_COUNT)
     {
-        channels &= ~(1 << bitPosition); // Establece el bit en la channel 3 en 0
+        return;
     }
 
-    ledBluetoothPairingDefy.setPairedChannels(channels);
+    ble_flash_data.currentChannel = conn_channel;
+    Runtime.storage().put(flash_base_addr, ble_flash_data);
+    Runtime.storage().commit();
+
+    update_current_channel();
+    update_channel_and_name();
+
+    ledBluetoothPairingDefy.setConnectedChannel(ble_flash_data.currentChannel);
+    ledBluetoothPairingDefy.setAvertisingModeOn(NOT_ON_ADVERTISING);
+    send_led_mode();
 }
 
-void BleManager::send_led_mode(void)
+void BleManager::adv_policy_wake(void)
 {
-    ::LEDControl.set_mode(10);
-    ::LEDControl.set_force_mode(true);
-    ColormapEffectDefy::updateBrigthness(ColormapEffectDefy::LedBrightnessControlEffect::BT_LED_EFFECT,
-                                         true,
-                                         false);
+    flag_adv_wake = true;
 }
 
-void BleManager::set_channel_in_use(KeyAddr key_addr)
+void BleManager::adv_set_state(AdvPolicyState state)
 {
-    const int colMapping[5][2] =
-    {
-        {1, 10},
-        {2, 11},
-        {3, 12},
-        {4, 13},
-        {5, 14}
-    };
+    uint32_t now = Runtime.millisAtCycleStart();
 
-    for (int i = 0; i < 5; i++)
+    if (adv_state == ADV_POLICY_FAST || adv_state == ADV_POLICY_SLOW_WINDOW)
     {
-        if ( (key_addr.col() == colMapping[i][0] || key_addr.col() == colMapping[i][1]) &&
-            (key_addr.row() == 0 || key_addr.row() == 1) )
-        {
-            channel_in_use = static_cast<Channels>(i);
-
-            break;
-        }
+        adv_stats.airtime_ms += now - ti_adv_state;
     }
+
+    adv_state = state;
+    ti_adv_state = now;
 }
 
-bool BleManager::getForceBle(void)
+void BleManager::adv_session_start(void)
 {
-    return ble_flash_data.forceBle;
+    bool bonded = (ble_flash_data.ble_connections[ble_flash_data.currentChannel].get_peer_id() != PM_PEER_ID_INVALID);
+    adv_fast_ms = bonded ? ADV_FAST_BONDED_MS : ADV_FAST_PAIRING_MS;
+    adv_total_ms = bonded ? ADV_TOTAL_BONDED_MS : ADV_TOTAL_PAIRING_MS;
+
+    uint8_t battery_level = ::Battery.getBatteryLevel();
+    if (battery_level < ADV_BATTERY_LOW || ::Battery.isSavingMode())
+    {
+        adv_fast_ms /= 2;
+        adv_total_ms /= 4;
+    }
+    if (battery_level < ADV_BATTERY_CRITICAL)
+    {
+        adv_total_ms = adv_fast_ms;
+    }
+
+    adv_stats.sessions++;
+    ti_adv_session = Runtime.millisAtCycleStart();
+    adv_set_state(ADV_POLICY_FAST);
+
+    start_advertising();
+
+#if BLE_MANAGER_DEBUG_LOG
+    NRF_LOG_DEBUG("Ble_manager: Advertising session, fast %lu ms, total %lu ms", adv_fast_ms, adv_total_ms);
+#endif
 }
 
-void BleManager::setForceBle(bool enabled)
+void BleManager::adv_stop_and_sleep(void)
 {
-    ble_flash_data.forceBle = enabled;
+    ble_adv_stop();
+    adv_set_state(ADV_POLICY_STOPPED);
 
-    // Save it in flash memory.
-    Runtime.storage().put(flash_base_addr, ble_flash_data);
-    Runtime.storage().commit();
+    LEDControl::disable();
+    Communications_protocol::Packet p{};
+    p.header.command = Communications_protocol::SLEEP;
+    Communications.sendPacket(p);
+
+#if BLE_MANAGER_DEBUG_LOG
+    NRF_LOG_DEBUG("Ble_manager: Advertising stopped, going to sleep.");
+#endif
 }
 
-EventHandlerResult BleManager::onFocusEvent(const char *command)
+void BleManager::adv_policy_run(void)
 {
-    //    if (::Focus.handleHelp(command, "wireless.bluetooth.devicesMap\nwireless.bluetooth.deviceName")) return EventHandlerResult::OK;
-    //
-    //    if (strncmp(command, "wireless.bluetooth.", 19) != 0) return EventHandlerResult::OK;
-    //    if (strcmp(command + 19, "devicesMap") == 0)
-    //    {
-    //        if (::Focus.isEOL())
-    //        {
-    //            for (const auto &connection : ble_flash_data.ble_connections)
-    //            {
-    //                connection.send();
-    //            }
-    //        }
-    //        else
-    //        {
-    //            for (auto &connection : ble_flash_data.ble_connections)
-    //            {
-    //                connection.read();
-    //            }
-    //
-    //            // Save it in flash memory.
-    //            Runtime.storage().put(flash_base_addr, ble_flash_data);
-    //            Runtime.storage().commit();
-    //        }
-    //    }
-    //
-    //    // This command need reset
-    //    if (strcmp(command + 19, "deviceName") == 0)
-    //    {
-    //        if (::Focus.isEOL())
-    //        {
-    //#if BLE_MANAGER_DEBUG_LOG
-    //            NRF_LOG_DEBUG("read request: wireless.bluetooth.deviceName");
-    //#endif
-    //
-    //            for (const auto &device_name_letter : ble_flash_data.defy_ble_name)
-    //            {
-    //                ::Focus.send((uint8_t)device_name_letter);
-    //            }
-    //        }
+    bool wake = flag_adv_wake;
+    flag_adv_wake = false;
+
+    /*
+        The link still up after a channel change belongs to the previous host, so it does not count
+        as a connection of the advertised channel. Nothing is advertised next to it, the channel
+        switch is the one dropping it.
+    */
+    if (ble_connected() && conn_channel != ble_flash_data.currentChannel)
+    {
+        if (adv_state == ADV_POLICY_FAST || adv_state == ADV_POLICY_SLOW_WINDOW)
+        {
+            ble_adv_stop();
+        }
+        if (adv_state != ADV_POLICY_START)
+        {
+            adv_set_state(ADV_POLICY_START);
+        }
+        return;
+    }
+
+    if (ble_connected())
+    {
+        if (adv_state != ADV_POLICY_CONNECTED)
+        {
+            if (adv_state != ADV_POLICY_START && adv_state != ADV_POLICY_STOPPED)
+            {
+                adv_stats.connects++;
+                adv_stats.last_connect_ms = Runtime.millisAtCycleStart() - ti_adv_session;
+                if (adv_stats.last_connect_ms > adv_stats.max_connect_ms)
+                {
+                    adv_stats.max_connect_ms = adv_stats.last_connect_ms;
+                }
+            }
+            adv_set_state(ADV_POLICY_CONNECTED);
+        }
+        return;
+    }
+
+    switch (adv_state)
+    {
+        case ADV_POLICY_CONNECTED:
+        {
+            // The link was lost, look for the host again.
+            adv_set_state(ADV_POLICY_START);
+        }
+        break;
+
+        case ADV_POLICY_START:
+        {
+            if (wake || LEDControl::isEnabled())
+            {
+                adv_session_start();
+            }
+        }
+        break;
+
+        case ADV_POLICY_FAST:
+        {
+            if (Runtime.hasTimeExpired(ti_adv_state, adv_fast_ms))
+            {
+                ble_adv_stop();
+                adv_pause_ms = ADV_SLOW_PAUSE_MIN_MS;
+                adv_set_state(ADV_POLICY_SLOW_PAUSE);
+            }
+        }
+        break;
+
+        case ADV_POLICY_SLOW_WINDOW:
+        {
+            if (wake)
+            {
+                adv_session_start();
+            }
+            else if (Runtime.hasTimeExpired(ti_adv_state, static_cast<uint32_t>(ADV_SLOW_WINDOW_MS)))
+            {
+                ble_adv_stop();
+                adv_pause_ms = min(adv_pause_ms * 2, static_cast<uint32_t>(ADV_SLOW_PAUSE_MAX_MS));
+                adv_set_state(ADV_POLICY_SLOW_PAUSE);
+            }
+        }
+        break;
+
+        case ADV_POLICY_SLOW_PAUSE:
+        {
+            if (wake)
+            {
+                adv_session_start();
+            }
+            else if (Runtime.hasTimeExpired(ti_adv_session, adv_total_ms))
+            {
+                adv_stop_and_sleep();
+            }
+            else if (Runtime.hasTimeExpired(ti_adv_state, adv_pause_ms))
+            {
+                adv_set_state(ADV_POLICY_SLOW_WINDOW);
+                start_bonded_advertising();
+            }
+        }
+        break;
+
+        case ADV_POLICY_STOPPED:
+        {
+            if (wake)
+            {
+                adv_session_start();
+            }
+        }
+        break;
+    }
+}
+
+void BleManager::start_advertising(void)
+{
+    ti_wake = Runtime.millisAtCycleStart();
+
+    if (start_directed_advertising())
+    {
+        return;
+    }
+
+    start_bonded_advertising();
+}
+
+bool BleManager::start_directed_advertising(void)
+{
+    pm_peer_id_t peer_id = ble_flash_data.ble_connections[ble_flash_data.currentChannel].get_peer_id();
+    if (peer_id == PM_PEER_ID_INVALID)
+    {
+        return false;
+    }
+
+    pm_peer_data_bonding_t bonding;
+    if (pm_peer_data_bonding_load(peer_id, &bonding) != NRF_SUCCESS)
+    {
+        return false;
+    }
+    directed_peer_addr = bonding.peer_ble_id.id_addr_info;
+
+    /*
+        The advertising module is not configured with the directed modes, so the set is configured
+        here. It goes back to the module with the whitelisted advertising when this one times out.
+    */
+    ble_adv_stop();
+
+    ble_gap_adv_params_t adv_params = {};
+    adv_params.properties.type = BLE_GAP_ADV_TYPE_CONNECTABLE_NONSCANNABLE_DIRECTED_HIGH_DUTY_CYCLE;
+    adv_params.p_peer_addr = &directed_peer_addr;
+    adv_params.filter_policy = BLE_GAP_ADV_FP_ANY;
+    adv_params.primary_phy = BLE_GAP_PHY_1MBPS;
+    adv_params.duration = BLE_GAP_ADV_TIMEOUT_HIGH_DUTY_MAX;
+
+    uint8_t adv_handle = ADV_DIRECTED_SET_HANDLE;
+    ret_code_t ret = sd_ble_gap_adv_set_configure(&adv_handle, NULL, &adv_params);
+    if (ret == NRF_SUCCESS)
+    {
+        ret = sd_ble_gap_adv_start(adv_handle, APP_BLE_CONN_CFG_TAG);
+    }
+
+#if BLE_MANAGER_DEBUG_LOG
+    NRF_LOG_INFO("Ble_manager: Directed advertising to peer %i, ret = %lu", peer_id, ret);
+#endif
+
+    if (ret != NRF_SUCCESS)
+    {
+        return false;
+    }
+
+    flag_directed_timeout = false;
+    fast_reconnect_state = FAST_RECONNECT_DIRECTED;
+    return true;
+}
+
+void BleManager::start_bonded_advertising(void)
+{
+    fast_reconnect_state = FAST_RECONNECT_ADVERTISING;
+
+    /*
+        If it doesn't have any device paired on the channel, it goes into
+        advertising with a whitelist so that any device can find it.
+    */
+    pm_peer_id_t active_connection_peer_id = ble_flash_data.ble_connections[ble_flash_data.currentChannel].get_peer_id();
+    if (active_connection_peer_id == PM_PEER_ID_INVALID)
+    {
+#if BLE_MANAGER_DEBUG_LOG
+        NRF_LOG_INFO("Ble_manager: Whitelist deactivated.");
+#endif
+        ble_goto_advertising_mode();
+    }
+    else
+    {
+#if BLE_MANAGER_DEBUG_LOG
+        NRF_LOG_INFO("Ble_manager: Whitelist activated.");
+#endif
+        ble_goto_white_list_advertising_mode();
+    }
+}
+
+void BleManager::fast_reconnect_run(void)
+{
+    if (flag_directed_timeout)
+    {
+        flag_directed_timeout = false;
+
+        // The host did not answer the directed advertising, the rest of the burst is whitelisted.
+        if (fast_reconnect_state == FAST_RECONNECT_DIRECTED && adv_state == ADV_POLICY_FAST && !ble_connected())
+        {
+            start_bonded_advertising();
+        }
+    }
+
+    if (flag_reconnected)
+    {
+        flag_reconnected = false;
+
+        // Skip the parameters negotiation with the values this host granted last time.
+        uint8_t channel = conn_channel;
+        if (channel < BLE_CONNECTIONS_COUNT && conn_params_cache_valid[channel] && conn_handle != BLE_CONN_HANDLE_INVALID)
+        {
+            /*
+                Counted as a request of conn_params_run(), so it waits for the host's answer
+                instead of replacing it in the same cycle.
+            */
+            ti_conn_params_request = Runtime.millisAtCycleStart();
+            conn_params_stats.requests++;
+            if (ble_conn_params_change_conn_params(conn_handle, &conn_params_cache[channel]) != NRF_SUCCESS)
+            {
+                conn_params_stats.rejected++;
+            }
+        }
+    }
+}
+
+void BleManager::anchor_sync_run(void)
+{
+    bool enable = ble_settings.anchor_sync && conn_handle != BLE_CONN_HANDLE_INVALID;
+    if (enable == anchor_sync_enabled)
+    {
+        return;
+    }
+    anchor_sync_enabled = enable;
+
+    if (enable)
+    {
+        sd_nvic_ClearPendingIRQ(SWI1_EGU1_IRQn);
+        sd_nvic_SetPriority(SWI1_EGU1_IRQn, APP_IRQ_PRIORITY_LOW);
+        sd_nvic_EnableIRQ(SWI1_EGU1_IRQn);
+        sd_radio_notification_cfg_set(NRF_RADIO_NOTIFICATION_TYPE_INT_ON_ACTIVE, ANCHOR_NOTIFICATION_DISTANCE);
+    }
+    else
+    {
+        sd_radio_notification_cfg_set(NRF_RADIO_NOTIFICATION_TYPE_NONE, ANCHOR_NOTIFICATION_DISTANCE);
+        sd_nvic_DisableIRQ(SWI1_EGU1_IRQn);
+        flag_anchor = false;
+    }
+
+#if BLE_MANAGER_DEBUG_LOG
+    NRF_LOG_DEBUG("Ble_manager: Anchor sync %s", enable ? "on" : "off");
+#endif
+}
+
+void BleManager::on_radio_active(void)
+{
+    anchor_count++;
+    flag_anchor = true;
+}
+
+bool BleManager::anchor_pass_pending(void)
+{
+    if (!flag_anchor)
+    {
+        return false;
+    }
+
+    flag_anchor = false;
+    anchor_passes++;
+    return true;
+}
+
+void BleManager::telemetry_reset(void)
+{
+    memset(&telemetry, 0, sizeof(telemetry));
+}
+
+void BleManager::mark_activity(void)
+{
+    ti_last_activity = Runtime.millisAtCycleStart();
+}
+
+bool BleManager::conn_params_match(ConnParamsMode mode, ble_gap_conn_params_t const &params)
+{
+    if (mode == CONN_PARAMS_ACTIVE)
+    {
+        return (params.max_conn_interval <= CONN_ACTIVE_MAX_INTERVAL && params.slave_latency == CONN_ACTIVE_SLAVE_LATENCY);
+    }
+
+    return (params.min_conn_interval >= CONN_IDLE_MIN_INTERVAL);
+}
+
+void BleManager::conn_params_run(void)
+{
+    if (conn_handle == BLE_CONN_HANDLE_INVALID || channel_switch_state != CHANNEL_SWITCH_IDLE)
+    {
+        return;
+    }
+
+    uint16_t idle_timeout_ms = min(ble_settings.idle_timeout_ms, idle_timeout_limit_ms);
+    ConnParamsMode mode = Runtime.hasTimeExpired(ti_last_activity, static_cast<uint32_t>(idle_timeout_ms)) ? CONN_PARAMS_IDLE : CONN_PARAMS_ACTIVE;
+
+    /*
+        The granted parameters are compared against the wanted mode, instead of remembering the
+        last request, so a host that changes them on its own is also handled.
+    */
+    if (conn_params_match(mode, conn_params_stats.granted))
+    {
+        return;
+    }
+
+    // Going active is urgent, going idle can wait for the host to settle.
+    uint32_t retry_ms = (mode == CONN_PARAMS_ACTIVE) ? CONN_PARAMS_RETRY_MS / 10 : CONN_PARAMS_RETRY_MS;
+    if (conn_params_stats.requests != 0 && !Runtime.hasTimeExpired(ti_conn_params_request, retry_ms))
+    {
+        return;
+    }
+
+    ble_gap_conn_params_t params;
+    if (mode == CONN_PARAMS_ACTIVE)
+    {
+        params.min_conn_interval = CONN_ACTIVE_MIN_INTERVAL;
+        params.max_conn_interval = CONN_ACTIVE_MAX_INTERVAL;
+        params.slave_latency = CONN_ACTIVE_SLAVE_LATENCY;
+    }
+    else
+    {
+        params.min_conn_interval = CONN_IDLE_MIN_INTERVAL;
+        params.max_conn_interval = CONN_IDLE_MAX_INTERVAL;
+        params.slave_latency = CONN_IDLE_SLAVE_LATENCY;
+    }
+    params.conn_sup_timeout = CONN_SUP_TIMEOUT;
+
+    ti_conn_params_request = Runtime.millisAtCycleStart();
+    conn_params_stats.requests++;
+
+    /*
+        The request goes through the Connection Parameters module, so it takes these values as the
+        preferred ones instead of negotiating its own again.
+    */
+    ret_code_t ret = ble_conn_params_change_conn_params(conn_handle, &params);
+    if (ret != NRF_SUCCESS)
+    {
+        conn_params_stats.rejected++;
+    }
+
+#if BLE_MANAGER_DEBUG_LOG
+    NRF_LOG_DEBUG("Ble_manager: Requesting %s connection parameters, ret = %lu", mode == CONN_PARAMS_ACTIVE ? "active" : "idle", ret);
+#endif
+}
+
+void BleManager::set_throughput_profile(bool high)
+{
+    throughput_high = high;
+
+    ble_gap_phys_t phys;
+    phys.tx_phys = high ? BLE_GAP_PHY_2MBPS : BLE_GAP_PHY_1MBPS;
+    phys.rx_phys = phys.tx_phys;
+    ret_code_t ret = sd_ble_gap_phy_update(conn_handle, &phys);
+
+    // Let the connection events run past NRF_SDH_BLE_GAP_EVENT_LENGTH while there is data to send.
+    ble_opt_t opt = {};
+    opt.common_opt.conn_evt_ext.enable = high ? 1 : 0;
+    sd_ble_opt_set(BLE_COMMON_OPT_CONN_EVT_EXT, &opt);
+
+    /*
+        nrf_ble_gatt keeps the default data length (NRF_SDH_BLE_GAP_DATA_LENGTH), the long packets
+        are only asked for during the transfer, so the key reports go back to short radio events.
+    */
+    uint16_t data_length = high ? BLE_THROUGHPUT_DATA_LENGTH : BLE_GAP_DATA_LENGTH_DEFAULT;
+    if (link_data_length != data_length)
+    {
+        ble_gap_data_length_params_t dl_params = {};
+        dl_params.max_tx_octets = data_length;
+        dl_params.max_rx_octets = data_length;
+        dl_params.max_tx_time_us = BLE_GAP_DATA_LENGTH_AUTO;
+        dl_params.max_rx_time_us = BLE_GAP_DATA_LENGTH_AUTO;
+        sd_ble_gap_data_length_update(conn_handle, &dl_params, NULL);
+    }
+
+#if BLE_MANAGER_DEBUG_LOG
+    NRF_LOG_DEBUG("Ble_manager: %s throughput profile, ret = %lu", high ? "High" : "Low power", ret);
+#endif
+}
+
+void BleManager::throughput_run(void)
+{
+    if (conn_handle == BLE_CONN_HANDLE_INVALID)
+    {
+        throughput_high = false;
+        return;
+    }
+
+    if (RawHID.pendingWrite() != 0 || RawHID.available() != 0)
+    {
+        if (ti_bulk_start == 0)
+        {
+            // New bulk transfer.
+            ti_bulk_start = Runtime.millisAtCycleStart();
+            bulk_bytes_start = RawHID.bleBytesSent();
+        }
+        ti_bulk_activity = Runtime.millisAtCycleStart();
+
+        mark_activity();  // Keep the short connection interval.
+    }
+    else if (ti_bulk_start != 0 && Runtime.hasTimeExpired(ti_bulk_activity, static_cast<uint32_t>(BULK_TRANSFER_END_MS)))
+    {
+        last_bulk_bytes = RawHID.bleBytesSent() - bulk_bytes_start;
+        last_bulk_time_ms = ti_bulk_activity - ti_bulk_start;
+        ti_bulk_start = 0;
+
+#if BLE_MANAGER_DEBUG_LOG
+        NRF_LOG_DEBUG("Ble_manager: Bulk transfer %lu bytes in %lu ms", last_bulk_bytes, last_bulk_time_ms);
+#endif
+    }
+
+    bool high;
+    if (throughput_mode == THROUGHPUT_AUTO)
+    {
+        high = (ti_bulk_start != 0);
+    }
+    else
+    {
+        high = (throughput_mode == THROUGHPUT_HIGH);
+    }
+
+    if (high != throughput_high)
+    {
+        set_throughput_profile(high);
+    }
+}
+
+void BleManager::on_ble_evt(ble_evt_t const *p_ble_evt)
+{
+    switch (p_ble_evt->header.evt_id)
+    {
+        case BLE_GAP_EVT_CONNECTED:
+        {
+            conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+            conn_channel = ble_flash_data.currentChannel;  // Only the current channel advertises.
+            conn_params_stats.granted = p_ble_evt->evt.gap_evt.params.connected.conn_params;
+
+            telemetry_reset();
+            sd_ble_gap_rssi_start(conn_handle, BLE_GAP_RSSI_THRESHOLD_INVALID, 0);
+
+            if (fast_reconnect_state == FAST_RECONNECT_ADVERTISING || fast_reconnect_state == FAST_RECONNECT_DIRECTED)
+            {
+                fast_reconnect_state = FAST_RECONNECT_WAIT_FIRST_REPORT;
+                flag_reconnected = true;
+            }
+        }
+        break;
+
+        case BLE_GAP_EVT_DISCONNECTED:
+        {
+            conn_handle = BLE_CONN_HANDLE_INVALID;
+            conn_channel = NOT_CONNECTED;
+            link_tx_phy = BLE_GAP_PHY_1MBPS;
+            link_data_length = BLE_GAP_DATA_LENGTH_DEFAULT;
+        }
+        break;
+
+        case BLE_GAP_EVT_PHY_UPDATE:
+        {
+            if (p_ble_evt->evt.gap_evt.params.phy_update.status == BLE_HCI_STATUS_CODE_SUCCESS)
+            {
+                link_tx_phy = p_ble_evt->evt.gap_evt.params.phy_update.tx_phy;
+            }
+        }
+        break;
+
+        case BLE_GAP_EVT_DATA_LENGTH_UPDATE:
+        {
+            link_data_length = p_ble_evt->evt.gap_evt.params.data_length_update.effective_params.max_tx_octets;
+        }
+        break;
+
+        case BLE_GAP_EVT_ADV_SET_TERMINATED:
+        {
+            if (fast_reconnect_state == FAST_RECONNECT_DIRECTED &&
+                p_ble_evt->evt.gap_evt.params.adv_set_terminated.reason == BLE_GAP_EVT_ADV_SET_TERMINATED_REASON_TIMEOUT)
+            {
+                flag_directed_timeout = true;
+            }
+        }
+        break;
+
+        case BLE_GAP_EVT_CONN_PARAM_UPDATE:
+        {
+            // Granted to the host of the link, the current channel may have changed since.
+            uint8_t channel = conn_channel;
+            if (channel < BLE_CONNECTIONS_COUNT)
+            {
+                conn_params_cache[channel] = p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params;
+                conn_params_cache_valid[channel] = true;
+            }
+
+            conn_params_stats.granted = p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params;
+            conn_params_stats.updates++;
+        }
+        break;
+
+        case BLE_GATTS_EVT_HVN_TX_COMPLETE:
+        {
+            if (p_ble_evt->evt.gatts_evt.conn_handle != conn_handle)
+            {
+                break;
+            }
+
+            uint8_t count = p_ble_evt->evt.gatts_evt.params.hvn_tx_complete.count;
+            CRITICAL_REGION_ENTER();
+            telemetry.in_flight = (telemetry.in_flight > count) ? telemetry.in_flight - count : 0;
+            CRITICAL_REGION_EXIT();
+        }
+        break;
+
+        default:
+        {
+        }
+        break;
+    }
+}
+
+void BleManager::on_report_sent(uint8_t id, bool ble, bool success, uint32_t latency_us)
+{
+    if (!ble)
+    {
+        return;
+    }
+
+    if (!success)
+    {
+        telemetry.failures++;
+        return;
+    }
+
+    telemetry.sent++;
+    // Decremented by the SoftDevice events, which can preempt this read-modify-write.
+    CRITICAL_REGION_ENTER();
+    telemetry.in_flight++;
+    if (telemetry.in_flight > telemetry.in_flight_max)
+    {
+        telemetry.in_flight_max = telemetry.in_flight;
+    }
+    CRITICAL_REGION_EXIT();
+
+    // RawHID does not go through the HID queue.
+    if (id != HID_REPORTID_RAWHID)
+    {
+        uint32_t latency_ms = latency_us / 1000;
+        uint8_t bucket = 0;
+        while (latency_ms != 0 && bucket < BLE_LATENCY_BUCKETS - 1)
+        {
+            latency_ms >>= 1;
+            bucket++;
+        }
+        telemetry.latency_histogram[bucket]++;
+    }
+
+    mark_activity();
+
+    if (fast_reconnect_state != FAST_RECONNECT_WAIT_FIRST_REPORT)
+    {
+        return;
+    }
+
+    fast_reconnect_state = FAST_RECONNECT_IDLE;
+    wake_to_first_report_ms = millis() - ti_wake;
+
+#if BLE_MANAGER_DEBUG_LOG
+    NRF_LOG_INFO("Ble_manager: Wake to first report %lu ms.", wake_to_first_report_ms);
+#endif
+}
+
+bool BleManager::is_num_key(uint16_t raw_key)
+{
+    /*
+        #define HID_KEYBOARD_1_AND_EXCLAMATION_POINT	0x1E	// Sel
+        #define HID_KEYBOARD_2_AND_AT			0x1F	// Sel
+        #define HID_KEYBOARD_3_AND_POUND		0x20	// Sel
+        #define HID_KEYBOARD_4_AND_DOLLAR		0x21	// Sel
+        #define HID_KEYBOARD_5_AND_PERCENT		0x22	// Sel
+        #define HID_KEYBOARD_6_AND_CARAT		0x23	// Sel
+        #define HID_KEYBOARD_7_AND_AMPERSAND		0x24	// Sel
+        #define HID_KEYBOARD_8_AND_ASTERISK		0x25	// Sel
+        #define HID_KEYBOARD_9_AND_LEFT_PAREN		0x26	// Sel
+        #define HID_KEYBOARD_0_AND_RIGHT_PAREN		0x27	// Sel
+    */
+    if ((raw_key >= HID_KEYBOARD_1_AND_EXCLAMATION_POINT) && (raw_key <= HID_KEYBOARD_0_AND_RIGHT_PAREN))
+    {
+        return true;
+    }
+
+    return false;
+}
+
+char BleManager::raw_key_to_ascii(uint16_t raw_key)
+{
+    uint8_t num = raw_key - HID_KEYBOARD_1_AND_EXCLAMATION_POINT + 1;
+
+    if (num != 10)
+    {
+        return (num + '0'); // To ASCII num.
+    }
+    else
+    {
+        return '0';
+    }
+}
+
+void BleManager::erase_paired_device(uint8_t index_channel)
+{
+    if (ble_flash_data.ble_connections[index_channel].get_peer_id() != PM_PEER_ID_INVALID)
+    {
+#if BLE_MANAGER_DEBUG_LOG
+        NRF_LOG_DEBUG("Ble_manager: Deleting paired device on channel %i...", index_channel);
+        NRF_LOG_FLUSH();
+#endif
+
+        connectionState[index_channel].timePressed = 0;
+        connectionState[index_channel].longPress = true;
+        uint8_t peerCount = pm_peer_count();
+        pm_peer_id_t peer_list[peerCount];
+        uint32_t list_size = peerCount;
+        pm_peer_id_list(peer_list, &list_size, PM_PEER_ID_INVALID, PM_PEER_ID_LIST_ALL_ID);
+
+        for (uint8_t i = 0; i < peerCount; ++i)
+        {
+            if (peer_list[i] != PM_PEER_ID_INVALID && peer_list[i] == ble_flash_data.ble_connections[index_channel].get_peer_id())
+            {
+                delete_peer_by_id(ble_flash_data.ble_connections[index_channel].get_peer_id());
+            }
+        }
+
+        ble_flash_data.ble_connections[index_channel].reset();
+        set_paired_channel_led(index_channel, false); // set channel related bit to 0
+
+        // Save it in flash memory.
+        Runtime.storage().put(flash_base_addr, ble_flash_data);
+        Runtime.storage().commit();
+
+        if (index_channel == ble_flash_data.currentChannel)
+        {
+            ledBluetoothPairingDefy.setConnectedChannel(NOT_CONNECTED);
+            ble_disconnect();
+            // We could remove this reset but a weird led effect happends when the channel is the same
+            reset_mcu();
+        }
+
+        ledBluetoothPairingDefy.setEreaseDone(true);
+        send_led_mode(); // this is to update the led effect.
+        ledBluetoothPairingDefy.setEreaseDone(false);
+    }
+}
+
+void BleManager::exit_pairing_mode(void)
+{
+#if BLE_MANAGER_DEBUG_LOG
+    NRF_LOG_DEBUG("Ble_manager: Exit pairing mode.");
+    NRF_LOG_FLUSH();
+#endif
+
+    show_bt_layer = false;
+    ColormapEffectDefy::updateBrigthness(ColormapEffectDefy::LedBrightnessControlEffect::BT_LED_EFFECT,
+                                         false,
+                                         true);
+    ::LEDControl.set_force_mode(false);
+    ::LEDControl.set_mode(0); // Disable LED fade effect.
+}
+
+void BleManager::set_paired_channel_led(uint8_t channel, bool turnOn)
+{
+    uint8_t bitPosition = channel; // Posición del bit que quieres establecer en 1 (empezando desde 0)
+    if (turnOn)
+    {
+        channels |= (1 << bitPosition); // Establece el bit en la channel 3 en 1
+    }
+    else
+    {
+        channels &= ~(1 << bitPosition); // Establece el bit en la channel 3 en 0
+    }
+
+    ledBluetoothPairingDefy.setPairedChannels(channels);
+}
+
+void BleManager::send_led_mode(void)
+{
+    ::LEDControl.set_mode(10);
+    ::LEDControl.set_force_mode(true);
+    ColormapEffectDefy::updateBrigthness(ColormapEffectDefy::LedBrightnessControlEffect::BT_LED_EFFECT,
+                                         true,
+                                         false);
+}
+
+void BleManager::set_channel_in_use(KeyAddr key_addr)
+{
+    const int colMapping[5][2] =
+    {
+        {1, 10},
+        {2, 11},
+        {3, 12},
+        {4, 13},
+        {5, 14}
+    };
+
+    for (int i = 0; i < 5; i++)
+    {
+        if ( (key_addr.col() == colMapping[i][0] || key_addr.col() == colMapping[i][1]) &&
+            (key_addr.row() == 0 || key_addr.row() == 1) )
+        {
+            channel_in_use = static_cast<Channels>(i);
+
+            break;
+        }
+    }
+}
+
+bool BleManager::getForceBle(void)
+{
+    return ble_flash_data.forceBle;
+}
+
+bool BleManager::isPairing(void)
+{
+    if (mitm_activated || channel_switch_state != CHANNEL_SWITCH_IDLE)
+    {
+        return true;
+    }
+
+    return ble_flash_data.ble_connections[ble_flash_data.currentChannel].get_peer_id() == PM_PEER_ID_INVALID;
+}
+
+void BleManager::setForceBle(bool enabled)
+{
+    ble_flash_data.forceBle = enabled;
+
+    // Save it in flash memory.
+    Runtime.storage().put(flash_base_addr, ble_flash_data);
+    Runtime.storage().commit();
+}
+
+EventHandlerResult BleManager::onFocusEvent(const char *command)
+{
+    //    if (::Focus.handleHelp(command, "wireless.bluetooth.devicesMap\nwireless.bluetooth.deviceName")) return EventHandlerResult::OK;
+    //
+    //    if (strncmp(command, "wireless.bluetooth.", 19) != 0) return EventHandlerResult::OK;
+    //    if (strcmp(command + 19, "devicesMap") == 0)
+    //    {
+    //        if (::Focus.isEOL())
+    //        {
+    //            for (const auto &connection : ble_flash_data.ble_connections)
+    //            {
+    //                connection.send();
+    //            }
+    //        }
+    //        else
+    //        {
+    //            for (auto &connection : ble_flash_data.ble_connections)
+    //            {
+    //                connection.read();
+    //            }
+    //
+    //            // Save it in flash memory.
+    //            Runtime.storage().put(flash_base_addr, ble_flash_data);
+    //            Runtime.storage().commit();
+    //        }
+    //    }
+    //
+    //    // This command need reset
+    //    if (strcmp(command + 19, "deviceName") == 0)
+    //    {
+    //        if (::Focus.isEOL())
+    //        {
+    //#if BLE_MANAGER_DEBUG_LOG
+    //            NRF_LOG_DEBUG("read request: wireless.bluetooth.deviceName");
+    //#endif
+    //
+    //            for (const auto &device_name_letter : ble_flash_data.defy_ble_name)
+    //            {
+    //                ::Focus.send((uint8_t)device_name_letter);
+    //            }
+    //        }
     //        else
     //        {
     //#if BLE_MANAGER_DEBUG_LOG
@@ -864,8 +1692,155 @@ EventHandlerResult BleManager::onFocusEvent(const char *command)
     //        }
     //    }
 
-    // return EventHandlerResult::EVENT_CONSUMED;
-    return EventHandlerResult::OK;
+    if (::Focus.handleHelp(command, "wireless.bluetooth.reconnectTime\nwireless.bluetooth.connParams\nwireless.bluetooth.idleTimeout\n"
+                                      "wireless.bluetooth.throughput\nwireless.bluetooth.throughputStats\n"
+                                      "wireless.bluetooth.telemetry\nwireless.bluetooth.latencyHistogram\n"
+                                      "wireless.bluetooth.anchorSync\nwireless.bluetooth.advStats"))
+        return EventHandlerResult::OK;
+
+    if (strncmp(command, "wireless.bluetooth.", 19) != 0) return EventHandlerResult::OK;
+
+    if (strcmp(command + 19, "reconnectTime") == 0)
+    {
+        if (::Focus.isEOL())
+        {
+#if BLE_MANAGER_DEBUG_LOG
+            NRF_LOG_DEBUG("read request: wireless.bluetooth.reconnectTime");
+#endif
+            ::Focus.send(wake_to_first_report_ms);
+        }
+    }
+
+    if (strcmp(command + 19, "connParams") == 0)
+    {
+        if (::Focus.isEOL())
+        {
+#if BLE_MANAGER_DEBUG_LOG
+            NRF_LOG_DEBUG("read request: wireless.bluetooth.connParams");
+#endif
+            ::Focus.send(conn_params_stats.requests,
+                         conn_params_stats.rejected,
+                         conn_params_stats.updates,
+                         conn_params_stats.granted.min_conn_interval,
+                         conn_params_stats.granted.max_conn_interval,
+                         conn_params_stats.granted.slave_latency,
+                         conn_params_stats.granted.conn_sup_timeout);
+        }
+    }
+
+    if (strcmp(command + 19, "idleTimeout") == 0)
+    {
+        if (::Focus.isEOL())
+        {
+            ::Focus.send(ble_settings.idle_timeout_ms);
+        }
+        else
+        {
+            ::Focus.read(ble_settings.idle_timeout_ms);
+            ble_settings.idle_timeout_ms = clamp_idle_timeout(ble_settings.idle_timeout_ms);
+
+            // Save it in flash memory.
+            Runtime.storage().put(settings_base_addr, ble_settings);
+            Runtime.storage().commit();
+        }
+    }
+
+    // 0 = auto (high only during bulk transfers), 1 = always low power, 2 = always high.
+    if (strcmp(command + 19, "throughput") == 0)
+    {
+        if (::Focus.isEOL())
+        {
+            ::Focus.send(static_cast<uint8_t>(throughput_mode));
+        }
+        else
+        {
+            uint8_t mode;
+            ::Focus.read(mode);
+            if (mode <= THROUGHPUT_HIGH)
+            {
+                throughput_mode = static_cast<ThroughputMode>(mode);
+            }
+        }
+    }
+
+    if (strcmp(command + 19, "throughputStats") == 0)
+    {
+        if (::Focus.isEOL())
+        {
+            uint32_t bytes_per_s = 0;
+            if (last_bulk_time_ms != 0)
+            {
+                bytes_per_s = (uint32_t)(((uint64_t)last_bulk_bytes * 1000) / last_bulk_time_ms);
+            }
+
+            ::Focus.send(last_bulk_bytes, last_bulk_time_ms, bytes_per_s, link_tx_phy, link_data_length);
+        }
+    }
+
+    if (strcmp(command + 19, "telemetry") == 0)
+    {
+        if (::Focus.isEOL())
+        {
+            if (conn_handle != BLE_CONN_HANDLE_INVALID)
+            {
+                uint8_t channel_index;
+                sd_ble_gap_rssi_get(conn_handle, &telemetry.rssi, &channel_index);
+            }
+
+            ::Focus.send(telemetry.rssi,
+                         conn_params_stats.granted.max_conn_interval,
+                         conn_params_stats.granted.slave_latency,
+                         link_tx_phy,
+                         telemetry.in_flight,
+                         telemetry.in_flight_max,
+                         telemetry.sent,
+                         telemetry.failures);
+        }
+    }
+
+    if (strcmp(command + 19, "latencyHistogram") == 0)
+    {
+        if (::Focus.isEOL())
+        {
+            for (auto count : telemetry.latency_histogram)
+            {
+                ::Focus.send(count);
+            }
+        }
+    }
+
+    if (strcmp(command + 19, "anchorSync") == 0)
+    {
+        if (::Focus.isEOL())
+        {
+            ::Focus.send(ble_settings.anchor_sync, anchor_count, anchor_passes);
+        }
+        else
+        {
+            uint8_t anchor_sync;
+            ::Focus.read(anchor_sync);
+            ble_settings.anchor_sync = (anchor_sync != 0);
+
+            // Save it in flash memory.
+            Runtime.storage().put(settings_base_addr, ble_settings);
+            Runtime.storage().commit();
+        }
+    }
+
+    if (strcmp(command + 19, "advStats") == 0)
+    {
+        if (::Focus.isEOL())
+        {
+            ::Focus.send(static_cast<uint8_t>(adv_state),
+                         adv_stats.sessions,
+                         adv_stats.airtime_ms,
+                         adv_stats.connects,
+                         adv_stats.last_connect_ms,
+                         adv_stats.max_connect_ms);
+        }
+    }
+
+    return EventHandlerResult::EVENT_CONSUMED;
 }
 
 EventHandlerResult BleManager::beforeReportingState(void)
@@ -893,3 +1868,19 @@ void device_name_evt_handler(void)
 
     BleManager.trigger_save_name_timer = true;
 }
+
+static void ble_manager_evt_handler(ble_evt_t const *p_ble_evt, void *p_context)
+{
+    BleManager.on_ble_evt(p_ble_evt);
+}
+
+static void ble_manager_report_sent_hook(uint8_t id, int len, bool ble, bool success, uint32_t latency_us)
+{
+    BleManager.on_report_sent(id, ble, success, latency_us);
+}
+
+// Radio notification interrupt of the SoftDevice.
+extern "C" void SWI1_EGU1_IRQHandler(void)
+{
+    BleManager.on_radio_active();
+}
@@ -28,6 +28,18 @@
 #include <Kaleidoscope-EEPROM-Settings.h>
 #include <Kaleidoscope-Ranges.h>
 
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "ble.h"
+#include "ble_gap.h"
+
+#ifdef __cplusplus
+}
+#endif
+
 namespace kaleidoscope
 {
 namespace plugin
@@ -104,6 +116,25 @@ class Ble_flash_data
     }
 };
 
+#define BLE_IDLE_TIMEOUT_MS_DEFAULT     5000
+#define BLE_IDLE_TIMEOUT_MS_MIN         1000
+#define BLE_IDLE_TIMEOUT_MS_MAX         60000
+#define CHANNEL_SWITCH_DISCONNECT_RETRIES   3  // Extra disconnect requests before a channel switch fails.
+#define BLE_LATENCY_BUCKETS             8  // <1ms, <2ms, <4ms ... <64ms, >=64ms.
+
+class Ble_settings
+{
+  public:
+    uint16_t idle_timeout_ms;  // Time without activity before requesting the idle connection parameters.
+    uint8_t anchor_sync;       // Extra key processing pass right before each connection event.
+
+    void reset(void)
+    {
+        idle_timeout_ms = BLE_IDLE_TIMEOUT_MS_DEFAULT;
+        anchor_sync = 0;
+    }
+};
+
 class BleManager : public Plugin
 {
   public:
@@ -116,8 +147,34 @@ class BleManager : public Plugin
     EventHandlerResult onFocusEvent(const char *command);
 
     void init(void);
+    /*
+        Requests the Ble_settings slice. It is called from setup() after the storage of the keymaps,
+        colormaps, superkeys and macros, so it does not move their offsets.
+    */
+    void reserve_settings(void);
     bool getForceBle(void);
     void setForceBle(bool enabled);
+    /*
+        The user is pairing a host: the current channel has no bond yet, the PIN is being entered or
+        the channel is being switched. Advertising to reconnect a bonded host is not pairing.
+    */
+    bool isPairing(void);
+
+    // Called from the SoftDevice event context.
+    void on_ble_evt(ble_evt_t const *p_ble_evt);
+    // Called each time a queued HID report is handed to the USB or BLE stack.
+    void on_report_sent(uint8_t id, bool ble, bool success, uint32_t latency_us);
+
+    // Called from the radio notification interrupt, shortly before the radio becomes active.
+    void on_radio_active(void);
+    // True once per radio notification, when a key processing pass should be run before the connection event.
+    bool anchor_pass_pending(void);
+
+    // Shortens the idle timeout of the connection parameters, set by the PowerGovernor on low battery.
+    void set_idle_timeout_limit(uint16_t limit_ms)
+    {
+        idle_timeout_limit_ms = max(limit_ms, static_cast<uint16_t>(BLE_IDLE_TIMEOUT_MS_MIN));
+    }
 
   private:
     enum Channels: uint8_t
@@ -146,6 +203,31 @@ class BleManager : public Plugin
 //        KEY_5 = 34,
 //    };
 
+    /*
+        Channel switching is done in steps. Each step starts when the SoftDevice reports the end of
+        the previous one (advertising stopped, link disconnected), or after a timeout. If the link
+        of the previous channel does not go down, the switch is undone.
+    */
+    enum ChannelSwitchState : uint8_t
+    {
+        CHANNEL_SWITCH_IDLE,
+        CHANNEL_SWITCH_WAIT_ADV_STOPPED,
+        CHANNEL_SWITCH_WAIT_DISCONNECTED,
+    };
+
+    /*
+        Fast reconnect: high duty cycle directed advertising to the bonded host of the channel,
+        whitelisted advertising if it does not answer, then the connection parameters this host
+        granted last time are requested right away.
+    */
+    enum FastReconnectState : uint8_t
+    {
+        FAST_RECONNECT_IDLE,
+        FAST_RECONNECT_DIRECTED,
+        FAST_RECONNECT_ADVERTISING,
+        FAST_RECONNECT_WAIT_FIRST_REPORT,
+    };
+
     struct ConnectionKeyState
     {
         bool longPress;
@@ -168,6 +250,159 @@ class BleManager : public Plugin
     bool timer_save_name_start_count = false;
     uint32_t ti_save_new_name = 0;
 
+    ChannelSwitchState channel_switch_state = CHANNEL_SWITCH_IDLE;
+    uint32_t ti_channel_switch_start = 0;
+    uint32_t ti_channel_switch_step = 0;
+    uint8_t channel_switch_retries = 0;
+
+    volatile FastReconnectState fast_reconnect_state = FAST_RECONNECT_IDLE;
+    volatile bool flag_reconnected = false;
+    volatile bool flag_directed_timeout = false;
+    ble_gap_addr_t directed_peer_addr = {};
+    volatile uint16_t conn_handle = BLE_CONN_HANDLE_INVALID;
+    volatile uint8_t conn_channel = NOT_CONNECTED;  // Channel the link was established on.
+    uint32_t ti_wake = 0;
+    uint32_t wake_to_first_report_ms = 0;  // Last measured reconnect latency.
+
+    // Last connection parameters granted by the host of each channel.
+    ble_gap_conn_params_t conn_params_cache[BLE_CONNECTIONS_COUNT] = {};
+    bool conn_params_cache_valid[BLE_CONNECTIONS_COUNT] = {};
+
+    /*
+        Activity adaptive connection parameters:
+        - Active: short interval and no peripheral latency while the user is typing.
+        - Idle: long interval with peripheral latency after Ble_settings::idle_timeout_ms without activity.
+    */
+    enum ConnParamsMode : uint8_t
+    {
+        CONN_PARAMS_ACTIVE,
+        CONN_PARAMS_IDLE,
+    };
+
+    struct ConnParamsStats
+    {
+        uint16_t requests;        // Parameter update requests sent to the host.
+        uint16_t rejected;        // Requests the SoftDevice did not accept (busy, invalid state).
+        uint16_t updates;         // Parameter updates granted by the host.
+        ble_gap_conn_params_t granted;  // Parameters currently in use.
+    };
+
+    uint16_t settings_base_addr = 0;
+    Ble_settings ble_settings;
+
+    uint32_t ti_last_activity = 0;
+    uint16_t idle_timeout_limit_ms = UINT16_MAX;
+    uint32_t ti_conn_params_request = 0;
+    ConnParamsStats conn_params_stats = {};
+
+    void mark_activity(void);
+    void conn_params_run(void);
+    bool conn_params_match(ConnParamsMode mode, ble_gap_conn_params_t const &params);
+
+    /*
+        Throughput profile: 2M PHY, long data length and connection event extension while a bulk
+        Focus transfer (RawHID over BLE) is running, 1M PHY, default data length and no extension
+        the rest of the time.
+    */
+    enum ThroughputMode : uint8_t
+    {
+        THROUGHPUT_AUTO,
+        THROUGHPUT_LOW_POWER,
+        THROUGHPUT_HIGH,
+    };
+
+    ThroughputMode throughput_mode = THROUGHPUT_AUTO;
+    bool throughput_high = false;
+    uint32_t ti_bulk_start = 0;
+    uint32_t ti_bulk_activity = 0;
+    uint32_t bulk_bytes_start = 0;
+    uint32_t last_bulk_bytes = 0;    // Bytes of the last bulk transfer.
+    uint32_t last_bulk_time_ms = 0;  // Duration of the last bulk transfer.
+    volatile uint8_t link_tx_phy = BLE_GAP_PHY_1MBPS;
+    volatile uint16_t link_data_length = BLE_GAP_DATA_LENGTH_DEFAULT;
+
+    void throughput_run(void);
+    void set_throughput_profile(bool high);
+
+    /*
+        Telemetry of the link the reports are sent to, for field debugging of lag reports.
+    */
+    struct LinkTelemetry
+    {
+        int8_t rssi;
+        uint16_t in_flight;       // Notifications queued in the SoftDevice and not yet sent.
+        uint16_t in_flight_max;
+        uint32_t sent;            // Successful ble_send_report calls.
+        uint32_t failures;        // Reports that could not be queued on the first attempt.
+        uint32_t latency_histogram[BLE_LATENCY_BUCKETS];  // Time from HID enqueue to notification.
+    };
+
+    LinkTelemetry telemetry = {};
+
+    void telemetry_reset(void);
+
+    /*
+        Anchor sync: the SoftDevice radio notification fires before every radio event, so the main
+        loop can process the latest key changes and queue the reports just before the connection
+        event instead of waiting for the next one.
+    */
+    bool anchor_sync_enabled = false;
+    volatile bool flag_anchor = false;
+    volatile uint32_t anchor_count = 0;
+    uint32_t anchor_passes = 0;
+
+    void anchor_sync_run(void);
+
+    /*
+        Advertising policy: a fast burst after wake, keypress or link loss, then short windows
+        of whitelisted advertising with growing pauses, then stop and sleep. The durations depend
+        on the bond of the channel and on the battery.
+    */
+    enum AdvPolicyState : uint8_t
+    {
+        ADV_POLICY_START,
+        ADV_POLICY_FAST,
+        ADV_POLICY_SLOW_WINDOW,
+        ADV_POLICY_SLOW_PAUSE,
+        ADV_POLICY_STOPPED,
+        ADV_POLICY_CONNECTED,
+    };
+
+    struct AdvPolicyStats
+    {
+        uint32_t sessions;
+        uint32_t airtime_ms;        // Time spent advertising.
+        uint32_t connects;
+        uint32_t last_connect_ms;   // Time from the start of the session to the connection.
+        uint32_t max_connect_ms;
+    };
+
+    AdvPolicyState adv_state = ADV_POLICY_START;
+    AdvPolicyStats adv_stats = {};
+    bool flag_adv_wake = false;
+    uint32_t ti_adv_session = 0;
+    uint32_t ti_adv_state = 0;
+    uint32_t adv_fast_ms = 0;
+    uint32_t adv_total_ms = 0;
+    uint32_t adv_pause_ms = 0;
+
+    void adv_policy_run(void);
+    void adv_policy_wake(void);
+    void adv_session_start(void);
+    void adv_set_state(AdvPolicyState state);
+    void adv_stop_and_sleep(void);
+
+    void start_advertising(void);
+    void start_bonded_advertising(void);
+    bool start_directed_advertising(void);
+    void fast_reconnect_run(void);
+
+    void start_channel_switch(uint8_t new_channel);
+    void channel_switch_run(uint32_t step_timeout_ms);
+    void channel_switch_disconnect(void);
+    void channel_switch_restore(void);
+    uint16_t clamp_idle_timeout(uint16_t timeout_ms);
+
     void timer_save_conn_run(uint32_t timeout_ms);
     void save_connection(void);
 
@@ -30,6 +30,8 @@
 
 #include "kaleidoscope/Runtime.h"
 #include "Arduino.h"
+#include "CRC_wrapper.h"
+#include "Flash_arbiter.h"
 #include "nrf_delay.h"
 
 #ifdef __cplusplus
@@ -38,11 +40,13 @@ extern "C"
 #endif
 
 #include "nrf_fstorage.h"
+#include "nrf_nvmc.h"
 
 #ifdef SOFTDEVICE_PRESENT
 #include "nrf_fstorage_sd.h"
 #include "nrf_sdh.h"
 #include "nrf_sdh_ble.h"
+#include "nrf_sdm.h"
 #else
 #include "nrf_drv_clock.h"
 #include "nrf_fstorage_nvmc.h"
@@ -93,7 +97,10 @@ extern "C"
         Page 115 (0x00073000) -> FDS library.
         Page 114 (0x00072000) -> FDS library.
 
-        Page 113 (0x00071000) -> Max Main App.
+        Page 113 (0x00071000) -> EEPROM class emergency journal. Always kept erased, except
+                                 between a fault/reset and the next image update.
+
+        Page 112 (0x00070000) -> Max Main App.
         .
         .
         Page 39  (0x00027000) -> Min Main App.
@@ -117,6 +124,43 @@ extern "C"
 
 #define LAST_PAGE_END_ADDR FLASH_STORAGE_FIRST_PAGE_START_ADDR + (FLASH_STORAGE_PAGE_SIZE * FLASH_STORAGE_NUM_PAGES) - 1
 
+/*
+    Emergency journal.
+    Each record is two flash words: the data word is written first and the header word last, so a
+    record interrupted in the middle is detected because its header is still erased.
+    The first record of the page is FLASH_JOURNAL_PAGE_MAGIC | FLASH_JOURNAL_PAGE_VERSION, written
+    with the first slice. A page with other content was not written by the journal (a bootloader
+    that used it as a DFU bank, for example): it is not replayed, and it is erased with the next update.
+    Header = FLASH_JOURNAL_RECORD_MAGIC | byte offset of the word inside the EEPROM image.
+    The records of one slice are followed by a commit record:
+    Header = FLASH_JOURNAL_COMMIT_MAGIC | number of records of the slice, data = CRC32 of those records.
+    The replay only applies records closed by a commit whose checksum matches, so a slice is restored
+    whole or not at all.
+    Writing one record takes 2 NVMC word writes (~41us each).
+    The page is outside the FLASH region of the linker script, so the app code never reaches it.
+*/
+#define FLASH_JOURNAL_PAGE_START_ADDR           0x00071000
+#define FLASH_JOURNAL_NUM_PAGES                 1
+#define FLASH_JOURNAL_END_ADDR                  FLASH_JOURNAL_PAGE_START_ADDR + (FLASH_STORAGE_PAGE_SIZE * FLASH_JOURNAL_NUM_PAGES) - 1
+#define FLASH_JOURNAL_PAGE_MAGIC                0x4A524E4C  /* "JRNL" */
+#define FLASH_JOURNAL_PAGE_VERSION              1
+#define FLASH_JOURNAL_FIRST_SLOT                1           /* Slot 0 holds the page magic. */
+#define FLASH_JOURNAL_RECORD_MAGIC              0xA5C30000
+#define FLASH_JOURNAL_COMMIT_MAGIC              0x5AC30000
+#define FLASH_JOURNAL_RECORD_MAGIC_MSK          0xFFFF0000
+#define FLASH_JOURNAL_RECORD_OFFSET_MSK         0x0000FFFF
+#define FLASH_JOURNAL_NUM_RECORDS               ((FLASH_STORAGE_PAGE_SIZE * FLASH_JOURNAL_NUM_PAGES) / sizeof(journal_record_t))
+#define FLASH_ERASED_WORD                       0xFFFFFFFF
+
+typedef struct
+{
+    uint32_t header;
+    uint32_t data;
+} journal_record_t;
+
+static journal_record_t const *const journal_records = (journal_record_t const *)FLASH_JOURNAL_PAGE_START_ADDR;
+static uint32_t const *const flash_image = (uint32_t const *)FLASH_STORAGE_FIRST_PAGE_START_ADDR;
+
 
 volatile static bool flag_write_completed = false;
 volatile static bool flag_erase_completed = false;
@@ -136,6 +180,13 @@ NRF_FSTORAGE_DEF(nrf_fstorage_t fstorage_instance) = {
     .end_addr = LAST_PAGE_END_ADDR,
 };
 
+// fstorage instance used only to erase the journal page once its records are in the image.
+NRF_FSTORAGE_DEF(nrf_fstorage_t journal_fstorage_instance) = {
+    .evt_handler = fstorage_evt_handler,
+    .start_addr = FLASH_JOURNAL_PAGE_START_ADDR,
+    .end_addr = FLASH_JOURNAL_END_ADDR,
+};
+
 static void fstorage_evt_handler(nrf_fstorage_evt_t *p_evt)
 {
     if (p_evt->result != NRF_SUCCESS)
@@ -200,6 +251,9 @@ void EEPROMClass::begin(size_t size)
     ret_code_t rc = nrf_fstorage_init(&fstorage_instance, fs_api, NULL);
     APP_ERROR_CHECK(rc);
 
+    rc = nrf_fstorage_init(&journal_fstorage_instance, fs_api, NULL);
+    APP_ERROR_CHECK(rc);
+
     if ((size <= 0) || (size > FLASH_STORAGE_NUM_PAGES * FLASH_STORAGE_PAGE_SIZE))
     {
         size = FLASH_STORAGE_NUM_PAGES * FLASH_STORAGE_PAGE_SIZE;
@@ -236,6 +290,9 @@ void EEPROMClass::begin(size_t size)
 #endif
 
     _dirty = false; // make sure dirty is cleared in case begin() is called 2nd+ time
+
+    // Apply the critical changes saved by the last fault or reset.
+    journal_replay();
 }
 
 bool EEPROMClass::end(void)
@@ -345,6 +402,24 @@ void EEPROMClass::update(void)
         return;
     }
 
+    // Every image update, and the journal erase after it, waits for its turn in the arbiter.
+    bool owned = FlashArbiter.eeprom_owned();
+    if (!owned)
+    {
+        FlashArbiter.wait_eeprom();
+    }
+
+    write_image();
+
+    if (!owned)
+    {
+        FlashArbiter.release_eeprom();
+    }
+}
+
+void EEPROMClass::write_image(void)
+{
+
     erase();
 
     while (nrf_fstorage_is_busy(NULL))  // Wait until fstorage is available.
@@ -377,6 +452,12 @@ void EEPROMClass::update(void)
         }
         needUpdate = false;
 
+        // The image now contains the journaled data, so the journal is erased for the next time.
+        if (journal_needs_erase)
+        {
+            journal_erase();
+        }
+
         /*
             It resets the periodic update timer since we just wrote the flash memory.
             This makes sense since the update() method can be called manually by the user, in addition
@@ -469,11 +550,18 @@ void EEPROMClass::timer_update_periodically_run(uint32_t timeout_ms)
     {
         if (EEPROM.getNeedUpdate())
         {
+            // Wait while the peer manager is using the flash, the timer stays expired so it is checked again next time.
+            if (!FlashArbiter.acquire_eeprom())
+            {
+                return;
+            }
+
 #if FLASH_STORAGE_DEBUG_WRITE
             NRF_LOG_DEBUG("EEPROM: Flash updated automatically.");
             NRF_LOG_FLUSH();
 #endif
             EEPROM.update();
+            FlashArbiter.release_eeprom();
         }
 //        else
 //        {
@@ -490,5 +578,354 @@ void EEPROMClass::reset_timer_update_periodically(void)
     ti_periodically_update = kaleidoscope::Runtime.millisAtCycleStart();
 }
 
+bool EEPROMClass::markCritical(int const address, size_t const size)
+{
+    if (address < 0 || size == 0 || address + size > EEPROM_EMULATION_SIZE)
+    {
+        return false;
+    }
+
+    if (critical_slices_count >= EEPROM_CRITICAL_SLICES_MAX)
+    {
+        NRF_LOG_ERROR("EEPROM: No room for more critical slices.");
+        return false;
+    }
+
+    critical_slices[critical_slices_count].address = address;
+    critical_slices[critical_slices_count].size = size;
+    critical_slices_count++;
+
+    return true;
+}
+
+bool EEPROMClass::canJournalPending(void)
+{
+    if (!needUpdate)
+    {
+        return true;
+    }
+
+    uint32_t records;
+    if (!scan_pending_words(records))
+    {
+        return false;  // There are changes outside the critical slices.
+    }
+
+    uint32_t slot = journal_free_slot();
+    if (slot == 0)
+    {
+        slot = FLASH_JOURNAL_FIRST_SLOT;  // The page magic is written with the first slice.
+    }
+    else if (!journal_page_valid())
+    {
+        return false;
+    }
+
+    return (records <= FLASH_JOURNAL_NUM_RECORDS - slot);
+}
+
+bool EEPROMClass::journalCritical(void)
+{
+    /*
+        This method can be called from the fault handler, so it does not use fstorage, it does not
+        wait for events and it does not call yield(). The NVMC is only accessible directly when the
+        SoftDevice is disabled.
+    */
+    if (!needUpdate || !_data)
+    {
+        return true;
+    }
+
+    uint32_t slot = journal_free_slot();
+    if (slot != 0 && !journal_page_valid())
+    {
+        return false;  // The page holds data the journal did not write, it is erased by the next update.
+    }
+
+#ifdef SOFTDEVICE_PRESENT
+    uint8_t sd_enabled = 0;
+    if (!svc_allowed())
+    {
+        /*
+            An SVC from this context escalates to a HardFault, so the SoftDevice state can not even
+            be read. The journal is skipped and the pending changes are lost.
+        */
+        return false;
+    }
+
+    (void)sd_softdevice_is_enabled(&sd_enabled);
+    if (sd_enabled && sd_softdevice_disable() != NRF_SUCCESS)
+    {
+        return false;
+    }
+#endif
+
+    if (slot == 0)
+    {
+        journal_write_record(slot++, FLASH_JOURNAL_PAGE_MAGIC, FLASH_JOURNAL_PAGE_VERSION);
+    }
+
+    bool all_saved = true;
+    for (uint8_t i = 0; i < critical_slices_count; i++)
+    {
+        uint32_t words = slice_pending_words(i);
+        if (words == 0)
+        {
+            continue;
+        }
+
+        if (slot + words + 1 > FLASH_JOURNAL_NUM_RECORDS)
+        {
+            all_saved = false;  // The slice does not fit whole in the journal.
+            continue;
+        }
+
+        uint32_t group_start = slot;
+        uint32_t first_offset = critical_slices[i].address & ~(sizeof(uint32_t) - 1);
+        uint32_t end_offset = critical_slices[i].address + critical_slices[i].size;
+        for (uint32_t offset = first_offset; offset < end_offset && offset + sizeof(uint32_t) <= _size; offset += sizeof(uint32_t))
+        {
+            uint32_t value;
+            memcpy(&value, _data + offset, sizeof(value));
+            if (value == flash_image[offset / sizeof(uint32_t)] && !journal_needs_erase)
+            {
+                continue;
+            }
+
+            journal_write_record(slot++, FLASH_JOURNAL_RECORD_MAGIC | offset, value);
+        }
+
+        // The checksum is taken from the flash, so it covers what was actually written.
+        uint32_t group_records = slot - group_start;
+        journal_write_record(slot++, FLASH_JOURNAL_COMMIT_MAGIC | group_records, journal_group_crc(group_start, group_records));
+    }
+
+    return all_saved;
+}
+
+bool EEPROMClass::svc_allowed(void)
+{
+    // SVC calls are only possible from thread mode or from an exception with lower priority than SVCall.
+    if (__get_PRIMASK() != 0)
+    {
+        return false;
+    }
+
+    uint32_t ipsr = __get_IPSR();
+    if (ipsr == 0)
+    {
+        return true;  // Thread mode.
+    }
+
+    if (ipsr < 4)
+    {
+        return false;  // NMI or HardFault, fixed priority above SVCall.
+    }
+
+    IRQn_Type active = (IRQn_Type)((int32_t)ipsr - 16);
+    return (NVIC_GetPriority(active) > NVIC_GetPriority(SVCall_IRQn));
+}
+
+uint32_t EEPROMClass::slice_pending_words(uint8_t slice)
+{
+    /*
+        If the journal still holds records, the image is not the last persisted state, so every
+        word of the slice is counted as pending.
+    */
+    uint32_t words = 0;
+    uint32_t first_offset = critical_slices[slice].address & ~(sizeof(uint32_t) - 1);
+    uint32_t end_offset = critical_slices[slice].address + critical_slices[slice].size;
+
+    for (uint32_t offset = first_offset; offset < end_offset && offset + sizeof(uint32_t) <= _size; offset += sizeof(uint32_t))
+    {
+        uint32_t value;
+        memcpy(&value, _data + offset, sizeof(value));
+        if (value != flash_image[offset / sizeof(uint32_t)] || journal_needs_erase)
+        {
+            words++;
+        }
+    }
+
+    return words;
+}
+
+bool EEPROMClass::is_critical_word(uint32_t offset)
+{
+    for (uint8_t i = 0; i < critical_slices_count; i++)
+    {
+        uint32_t slice_start = critical_slices[i].address;
+        uint32_t slice_end = slice_start + critical_slices[i].size;
+
+        if (offset < slice_end && offset + sizeof(uint32_t) > slice_start)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool EEPROMClass::scan_pending_words(uint32_t &records)
+{
+    /*
+        Compares the RAM buffer against the image in flash, word by word, and counts the journal
+        records needed to save every critical slice with pending changes, commit records included.
+        Returns false if some change is outside the critical slices.
+    */
+    records = 0;
+
+    for (uint32_t offset = 0; offset + sizeof(uint32_t) <= _size; offset += sizeof(uint32_t))
+    {
+        uint32_t value;
+        memcpy(&value, _data + offset, sizeof(value));
+
+        if (value != flash_image[offset / sizeof(uint32_t)] && !is_critical_word(offset))
+        {
+            return false;
+        }
+    }
+
+    for (uint8_t i = 0; i < critical_slices_count; i++)
+    {
+        uint32_t words = slice_pending_words(i);
+        if (words != 0)
+        {
+            records += words + 1;
+        }
+    }
+
+    return true;
+}
+
+void EEPROMClass::journal_write_record(uint32_t slot, uint32_t header, uint32_t data)
+{
+    uint32_t record_addr = FLASH_JOURNAL_PAGE_START_ADDR + slot * sizeof(journal_record_t);
+    nrf_nvmc_write_word(record_addr + offsetof(journal_record_t, data), data);
+    nrf_nvmc_write_word(record_addr + offsetof(journal_record_t, header), header);
+}
+
+bool EEPROMClass::journal_page_valid(void)
+{
+    return (journal_records[0].header == FLASH_JOURNAL_PAGE_MAGIC && journal_records[0].data == FLASH_JOURNAL_PAGE_VERSION);
+}
+
+uint32_t EEPROMClass::journal_group_crc(uint32_t first_slot, uint32_t records)
+{
+    return crc32(reinterpret_cast<uint8_t const *>(&journal_records[first_slot]), records * sizeof(journal_record_t));
+}
+
+uint32_t EEPROMClass::journal_free_slot(void)
+{
+    // Records are always appended, so the first fully erased record is the end of the journal.
+    uint32_t slot = 0;
+    while (slot < FLASH_JOURNAL_NUM_RECORDS &&
+           (journal_records[slot].header != FLASH_ERASED_WORD || journal_records[slot].data != FLASH_ERASED_WORD))
+    {
+        slot++;
+    }
+
+    return slot;
+}
+
+void EEPROMClass::journal_replay(void)
+{
+    uint32_t end_slot = journal_free_slot();
+    if (end_slot == 0)
+    {
+        return;  // Erased page, nothing was journaled.
+    }
+
+    // Whatever the page holds, it is erased once the image is written again.
+    journal_needs_erase = true;
+    needUpdate = true;
+
+    if (!journal_page_valid())
+    {
+        NRF_LOG_WARNING("EEPROM: The journal page holds foreign data, it is not replayed.");
+        NRF_LOG_FLUSH();
+
+        return;
+    }
+
+    uint32_t replayed = 0;
+    uint32_t discarded = 0;
+    uint32_t group_start = FLASH_JOURNAL_FIRST_SLOT;
+
+    for (uint32_t slot = FLASH_JOURNAL_FIRST_SLOT; slot < end_slot; slot++)
+    {
+        if ((journal_records[slot].header & FLASH_JOURNAL_RECORD_MAGIC_MSK) != FLASH_JOURNAL_COMMIT_MAGIC)
+        {
+            continue;  // Slice record, applied when its commit record is found.
+        }
+
+        /*
+            Commit record: the slice is the records just before it. Records between the previous
+            commit and the slice belong to a slice that was interrupted, and are left out.
+        */
+        uint32_t group_records = journal_records[slot].header & FLASH_JOURNAL_RECORD_OFFSET_MSK;
+        if (group_records > slot - group_start ||
+            journal_group_crc(slot - group_records, group_records) != journal_records[slot].data)
+        {
+            discarded++;
+            group_start = slot + 1;
+            continue;
+        }
+
+        for (uint32_t record = slot - group_records; record < slot; record++)
+        {
+            uint32_t offset = journal_records[record].header & FLASH_JOURNAL_RECORD_OFFSET_MSK;
+            if ((journal_records[record].header & FLASH_JOURNAL_RECORD_MAGIC_MSK) != FLASH_JOURNAL_RECORD_MAGIC ||
+                offset + sizeof(uint32_t) > _size)
+            {
+                continue;
+            }
+
+            memcpy(_data + offset, &journal_records[record].data, sizeof(uint32_t));
+            replayed++;
+        }
+
+        group_start = slot + 1;
+    }
+
+    if (discarded != 0)
+    {
+        NRF_LOG_WARNING("EEPROM: %lu journaled slices failed their checksum.", discarded);
+        NRF_LOG_FLUSH();
+    }
+
+#if FLASH_STORAGE_DEBUG_READ
+    NRF_LOG_DEBUG("EEPROM: Replayed %lu journal records.", replayed);
+    NRF_LOG_FLUSH();
+#endif
+}
+
+void EEPROMClass::journal_erase(void)
+{
+    while (nrf_fstorage_is_busy(NULL))  // Wait until fstorage is available.
+    {
+        yield();  // Meanwhile execute tasks.
+    }
+
+    flag_erase_completed = false;
+    ret_code_t ret_code = nrf_fstorage_erase(&journal_fstorage_instance,
+                                             FLASH_JOURNAL_PAGE_START_ADDR,
+                                             FLASH_JOURNAL_NUM_PAGES,
+                                             NULL);
+    if (ret_code != NRF_SUCCESS)
+    {
+        NRF_LOG_ERROR("EEPROM: Journal erase error, ret_code = %lu", ret_code);
+        NRF_LOG_FLUSH();
+
+        return;
+    }
+
+    while (!flag_erase_completed)
+    {
+        yield();  // Meanwhile execute tasks.
+    }
+
+    journal_needs_erase = false;
+}
+
 
 EEPROMClass EEPROM;
@@ -33,6 +33,9 @@
 #include <string.h>
 
 
+#define EEPROM_CRITICAL_SLICES_MAX  8
+
+
 class EEPROMClass
 {
     public:
@@ -54,6 +57,22 @@ class EEPROMClass
         void reset_timer_update_periodically(void);
         uint8_t read(int const address);
 
+        /*
+            Critical slices and emergency journal:
+            - The markCritical() method registers a region of the RAM buffer whose changes must
+              survive a fault or a reset even if update() had no time to run.
+            - The canJournalPending() method tells if every pending change is inside a critical
+              slice and fits in the free space of the journal.
+            - The journalCritical() method appends only the dirty words of the critical slices to a
+              pre-erased flash page, without erasing anything. Each slice is journaled whole or not
+              at all, and nothing is written when the caller can not issue SoftDevice calls. It is meant for the fault handler and
+              reset_mcu(). The next begin() replays the journal over the image, the slices whose
+              checksum matches and only if the page carries the journal magic.
+        */
+        bool markCritical(int const address, size_t const size);
+        bool canJournalPending(void);
+        bool journalCritical(void);
+
         void erase(void);
         uint8_t *getDataPtr(void);
         uint8_t const *getConstDataPtr(void) const;
@@ -117,6 +136,27 @@ class EEPROMClass
 
         bool trigger_update_periodically_timer = true;
         uint32_t ti_periodically_update = 0;
+
+        struct CriticalSlice
+        {
+            uint16_t address;
+            uint16_t size;
+        };
+        CriticalSlice critical_slices[EEPROM_CRITICAL_SLICES_MAX] = {};
+        uint8_t critical_slices_count = 0;
+        bool journal_needs_erase = false;
+
+        bool is_critical_word(uint32_t offset);
+        void write_image(void);
+        bool svc_allowed(void);
+        uint32_t slice_pending_words(uint8_t slice);
+        bool scan_pending_words(uint32_t &records);
+        void journal_write_record(uint32_t slot, uint32_t header, uint32_t data);
+        bool journal_page_valid(void);
+        uint32_t journal_group_crc(uint32_t first_slot, uint32_t records);
+        uint32_t journal_free_slot(void);
+        void journal_replay(void);
+        void journal_erase(void);
 };
 
 extern EEPROMClass EEPROM;
@@ -0,0 +1,311 @@
+/* -*- mode: c++ -*-
+ * kaleidoscope::plugin::FlashArbiter -- Serialise the flash operations of the EEPROM and the peer manager
+ * Copyright (C) 2020  Dygma Lab S.L.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "Flash_arbiter.h"
+
+#include "Ble_composite_dev.h"
+#include "Kaleidoscope-FocusSerial.h"
+#include "kaleidoscope/key_events.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "peer_manager.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+static void flash_arbiter_fds_evt_handler(fds_evt_t const *p_evt);
+
+// The original pm_handler_flash_clean() of the SDK, see -Wl,--wrap in the Makefile.
+extern "C" void __real_pm_handler_flash_clean(pm_evt_t const *p_pm_evt);
+
+namespace kaleidoscope
+{
+namespace plugin
+{
+
+#define FLASH_ARBITER_DEBUG_LOG     0
+
+#define FDS_SETTLE_MS               100    // FDS is considered busy for this time after each of its events.
+#define FLASH_EEPROM_MAX_WAIT_MS    2000   // The EEPROM update does not wait longer than this for FDS.
+#define FLASH_GC_IDLE_MS            3000   // Time without key activity before running the FDS garbage collection.
+#define FLASH_GC_MAX_DEFER_MS       30000  // Max deferral of a garbage collection requested by the peer manager.
+#define FLASH_GC_CHECK_MS           10000  // Period of the check for freeable space in FDS.
+#define FLASH_GC_MAX_MS             5000   // A garbage collection without FDS_EVT_GC by then is considered lost.
+#define FLASH_GC_FREEABLE_WORDS     (FDS_VIRTUAL_PAGE_SIZE / 2)
+
+EventHandlerResult FlashArbiter::onSetup()
+{
+    fds_register(flash_arbiter_fds_evt_handler);
+
+    return EventHandlerResult::OK;
+}
+
+EventHandlerResult FlashArbiter::beforeEachCycle()
+{
+    gc_done_run();
+    gc_run();
+
+    return EventHandlerResult::OK;
+}
+
+void FlashArbiter::gc_done_run(void)
+{
+    // Never keep the EEPROM out of the flash for a collection that does not end.
+    if (owner == OWNER_FDS_GC && !flag_gc_done && millis() - ti_gc_start >= FLASH_GC_MAX_MS)
+    {
+        NRF_LOG_WARNING("Flash_arbiter: FDS garbage collection timeout.");
+        flag_gc_done = true;
+    }
+
+    if (!flag_gc_done)
+    {
+        return;
+    }
+
+    flag_gc_done = false;
+    gc_pending = false;
+    gc_requested = false;
+    if (owner == OWNER_FDS_GC)
+    {
+        owner = OWNER_NONE;
+    }
+
+#if FLASH_ARBITER_DEBUG_LOG
+    NRF_LOG_DEBUG("Flash_arbiter: FDS garbage collection done.");
+#endif
+}
+
+EventHandlerResult FlashArbiter::onKeyswitchEvent(Key &mapped_key, KeyAddr key_addr, uint8_t key_state)
+{
+    if (keyToggledOn(key_state) || keyToggledOff(key_state))
+    {
+        ti_key_activity = Runtime.millisAtCycleStart();
+    }
+
+    return EventHandlerResult::OK;
+}
+
+bool FlashArbiter::acquire_eeprom(void)
+{
+    /*
+        It can be called from a loop that only yields (wait_eeprom()), where the cycle time does not
+        advance and beforeEachCycle() does not run, so it uses millis() and checks the GC end itself.
+    */
+    gc_done_run();
+
+    if (owner == OWNER_EEPROM)
+    {
+        return true;
+    }
+
+    if (!eeprom_waiting)
+    {
+        eeprom_waiting = true;
+        ti_eeprom_request = millis();
+    }
+
+    if (owner != OWNER_NONE)
+    {
+        return false;
+    }
+
+    if (fds_busy() && millis() - ti_eeprom_request < FLASH_EEPROM_MAX_WAIT_MS)
+    {
+        return false;
+    }
+
+    owner = OWNER_EEPROM;
+    eeprom_waiting = false;
+    update_wait(eeprom_wait, ti_eeprom_request);
+
+    return true;
+}
+
+void FlashArbiter::wait_eeprom(void)
+{
+    while (!acquire_eeprom())
+    {
+        yield();  // Meanwhile execute tasks.
+    }
+}
+
+void FlashArbiter::release_eeprom(void)
+{
+    if (owner == OWNER_EEPROM)
+    {
+        owner = OWNER_NONE;
+    }
+}
+
+bool FlashArbiter::fds_busy(void)
+{
+    if (millis() - ti_fds_activity < FDS_SETTLE_MS)
+    {
+        return true;
+    }
+
+    // Space is reserved while the writes of the peer manager are queued.
+    fds_stat_t stat;
+    if (fds_stat(&stat) == NRF_SUCCESS && stat.words_reserved != 0)
+    {
+        return true;
+    }
+
+    return false;
+}
+
+bool FlashArbiter::keyboard_idle(void)
+{
+    return Runtime.hasTimeExpired(ti_key_activity, static_cast<uint32_t>(FLASH_GC_IDLE_MS));
+}
+
+void FlashArbiter::gc_run(void)
+{
+    if (gc_requested && !gc_pending)
+    {
+        gc_pending = true;
+        ti_gc_request = Runtime.millisAtCycleStart();
+    }
+
+    // Look for deleted bonds in the idle periods, so the peer manager does not run out of space while pairing.
+    if (!gc_pending && keyboard_idle() && Runtime.hasTimeExpired(ti_gc_check, static_cast<uint32_t>(FLASH_GC_CHECK_MS)))
+    {
+        ti_gc_check = Runtime.millisAtCycleStart();
+
+        fds_stat_t stat;
+        if (fds_stat(&stat) == NRF_SUCCESS && stat.freeable_words >= FLASH_GC_FREEABLE_WORDS)
+        {
+            gc_pending = true;
+            ti_gc_request = Runtime.millisAtCycleStart();
+        }
+    }
+
+    if (!gc_pending || owner != OWNER_NONE || eeprom_waiting || fds_busy())
+    {
+        return;
+    }
+
+    bool overdue = gc_requested && Runtime.hasTimeExpired(ti_gc_request, static_cast<uint32_t>(FLASH_GC_MAX_DEFER_MS));
+    if (!keyboard_idle() && !overdue)
+    {
+        return;
+    }
+
+    if (gc_requested)
+    {
+        fds_stat_t stat;
+        if (fds_stat(&stat) == NRF_SUCCESS && stat.dirty_records == 0)
+        {
+            /*
+                Nothing to collect, the SDK handler deletes the lowest ranked peer instead. That is
+                a plain FDS write, covered by fds_busy(), so the flash is not owned for it.
+            */
+            __real_pm_handler_flash_clean(&storage_full_evt);
+            gc_requested = false;
+            gc_pending = false;
+            return;
+        }
+    }
+
+    // Owned only once the collection is actually queued, FDS_EVT_GC then releases it.
+    if (fds_gc() != NRF_SUCCESS)
+    {
+        return;  // The FDS queue is full, try again in the next cycle.
+    }
+
+    owner = OWNER_FDS_GC;
+    ti_gc_start = millis();
+    update_wait(gc_wait, ti_gc_request);
+
+#if FLASH_ARBITER_DEBUG_LOG
+    NRF_LOG_DEBUG("Flash_arbiter: FDS garbage collection started after %lu ms.", gc_wait.last_ms);
+#endif
+}
+
+void FlashArbiter::update_wait(WaitStats &stats, uint32_t ti_request)
+{
+    stats.count++;
+    stats.last_ms = millis() - ti_request;
+    if (stats.last_ms > stats.max_ms)
+    {
+        stats.max_ms = stats.last_ms;
+    }
+}
+
+void FlashArbiter::on_fds_evt(fds_evt_t const *p_evt)
+{
+    ti_fds_activity = millis();
+
+    if (p_evt->id == FDS_EVT_GC)
+    {
+        flag_gc_done = true;
+    }
+}
+
+void FlashArbiter::on_storage_full(pm_evt_t const *p_evt)
+{
+    storage_full_evt = *p_evt;
+    gc_requested = true;
+}
+
+EventHandlerResult FlashArbiter::onFocusEvent(const char *command)
+{
+    if (::Focus.handleHelp(command, "flash.arbiter")) return EventHandlerResult::OK;
+
+    if (strcmp(command, "flash.arbiter") != 0) return EventHandlerResult::OK;
+
+    if (::Focus.isEOL())
+    {
+        uint8_t queue_depth = (eeprom_waiting ? 1 : 0) + (gc_pending ? 1 : 0);
+
+        ::Focus.send(static_cast<uint8_t>(owner), queue_depth);
+        ::Focus.send(eeprom_wait.count, eeprom_wait.last_ms, eeprom_wait.max_ms);
+        ::Focus.send(gc_wait.count, gc_wait.last_ms, gc_wait.max_ms);
+    }
+
+    return EventHandlerResult::EVENT_CONSUMED;
+}
+
+} // namespace plugin
+} // namespace kaleidoscope
+
+
+kaleidoscope::plugin::FlashArbiter FlashArbiter;
+
+
+static void flash_arbiter_fds_evt_handler(fds_evt_t const *p_evt)
+{
+    FlashArbiter.on_fds_evt(p_evt);
+}
+
+extern "C" void __wrap_pm_handler_flash_clean(pm_evt_t const *p_pm_evt)
+{
+    // The collection waits for its turn, the other events keep their SDK handling.
+    if (p_pm_evt->evt_id == PM_EVT_STORAGE_FULL)
+    {
+        FlashArbiter.on_storage_full(p_pm_evt);
+        return;
+    }
+
+    __real_pm_handler_flash_clean(p_pm_evt);
+}
@@ -0,0 +1,129 @@
+/* -*- mode: c++ -*-
+ * kaleidoscope::plugin::FlashArbiter -- Serialise the flash operations of the EEPROM and the peer manager
+ * Copyright (C) 2020  Dygma Lab S.L.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "kaleidoscope/Runtime.h"
+#include "kaleidoscope/plugin.h"
+#include <Arduino.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "fds.h"
+#include "peer_manager_types.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+namespace kaleidoscope
+{
+namespace plugin
+{
+
+/*
+    The EEPROM image (EEPROMClass) and the bonds of the peer manager (FDS) share the fstorage queue
+    and the radio timing of the SoftDevice. The arbiter gives the flash to one of them at a time:
+    - EEPROMClass asks for it before the periodic update(), and waits while FDS is working.
+    - The FDS garbage collection is deferred until the keyboard is idle and the EEPROM is not
+      writing, so bonding never stalls the typing.
+    - The PM_EVT_STORAGE_FULL handling of pm_handler_flash_clean(), which Ble_composite_dev calls
+      from its peer manager handler, is wrapped at link time (-Wl,--wrap). The event is held here
+      until the arbiter gives the flash to FDS. Then the arbiter starts the collection itself, or
+      hands the event to the real handler when there is nothing to collect and a peer has to go.
+    - The flash is owned by a collection only once fds_gc() has queued it, and for at most
+      FLASH_GC_MAX_MS if FDS_EVT_GC never comes.
+*/
+class FlashArbiter : public Plugin
+{
+  public:
+    enum Owner : uint8_t
+    {
+        OWNER_NONE,
+        OWNER_EEPROM,
+        OWNER_FDS_GC,
+    };
+
+    EventHandlerResult onSetup();
+    EventHandlerResult beforeEachCycle();
+    EventHandlerResult onKeyswitchEvent(Key &mapped_key, KeyAddr key_addr, uint8_t key_state);
+    EventHandlerResult onFocusEvent(const char *command);
+
+    /*
+        Returns true when the EEPROM can write the flash now, and then release_eeprom() must be
+        called when done. While it returns false the request is counted as waiting.
+    */
+    bool acquire_eeprom(void);
+    void release_eeprom(void);
+    // Blocking version of acquire_eeprom() for update() calls outside the periodic update, yields while waiting.
+    void wait_eeprom(void);
+
+    bool eeprom_owned(void)
+    {
+        return owner == OWNER_EEPROM;
+    }
+
+    // A flash operation is running or waiting for its turn.
+    bool busy(void)
+    {
+        return owner != OWNER_NONE || eeprom_waiting || gc_pending;
+    }
+
+    void on_fds_evt(fds_evt_t const *p_evt);
+    void on_storage_full(pm_evt_t const *p_evt);
+
+  private:
+    struct WaitStats
+    {
+        uint32_t count;
+        uint32_t last_ms;
+        uint32_t max_ms;
+    };
+
+    Owner owner = OWNER_NONE;
+
+    bool eeprom_waiting = false;
+    uint32_t ti_eeprom_request = 0;
+    WaitStats eeprom_wait = {};
+
+    volatile bool gc_requested = false;     // The peer manager ran out of space.
+    pm_evt_t storage_full_evt = {};         // Held PM_EVT_STORAGE_FULL, for pm_handler_flash_clean().
+    volatile bool flag_gc_done = false;
+    bool gc_pending = false;
+    uint32_t ti_gc_request = 0;
+    uint32_t ti_gc_start = 0;
+    WaitStats gc_wait = {};
+
+    volatile uint32_t ti_fds_activity = 0;  // Last FDS operation of the peer manager.
+    uint32_t ti_key_activity = 0;
+    uint32_t ti_gc_check = 0;
+
+    void gc_done_run(void);
+    bool fds_busy(void);
+    bool keyboard_idle(void);
+    void gc_run(void);
+    void update_wait(WaitStats &stats, uint32_t ti_request);
+};
+
+} // namespace plugin
+} // namespace kaleidoscope
+
+extern kaleidoscope::plugin::FlashArbiter FlashArbiter;
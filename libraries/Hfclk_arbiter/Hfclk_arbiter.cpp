@@ -0,0 +1,51 @@
+/* -*- mode: c++ -*-
+ * kaleidoscope::plugin::HfclkArbiter -- Report of the HFXO arbiter
+ * Copyright (C) 2020  Dygma Lab S.L.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "Hfclk_arbiter.h"
+
+#include "Kaleidoscope-FocusSerial.h"
+
+namespace kaleidoscope
+{
+namespace plugin
+{
+
+EventHandlerResult HfclkArbiter::onFocusEvent(const char *command)
+{
+    if (::Focus.handleHelp(command, "power.hfclk")) return EventHandlerResult::OK;
+
+    if (strcmp(command, "power.hfclk") != 0) return EventHandlerResult::OK;
+
+    // Requests in place, then per user (RF, USB): requested, times requested, ms requested.
+    if (::Focus.isEOL())
+    {
+        ::Focus.send(hfclk_arbiter_ref_count());
+        for (uint8_t i = 0; i < HFCLK_USER_COUNT; i++)
+        {
+            hfclk_user_t user = static_cast<hfclk_user_t>(i);
+            ::Focus.send(static_cast<uint8_t>(hfclk_arbiter_is_requested(user)), hfclk_arbiter_request_count(user), hfclk_arbiter_on_time_ms(user));
+        }
+    }
+
+    return EventHandlerResult::EVENT_CONSUMED;
+}
+
+} // namespace plugin
+} // namespace kaleidoscope
+
+kaleidoscope::plugin::HfclkArbiter HfclkArbiter;
@@ -0,0 +1,40 @@
+/* -*- mode: c++ -*-
+ * kaleidoscope::plugin::HfclkArbiter -- Report of the HFXO arbiter
+ * Copyright (C) 2020  Dygma Lab S.L.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "hfclk_arbiter.h"
+#include "kaleidoscope/Runtime.h"
+#include "kaleidoscope/plugin.h"
+#include <Arduino.h>
+
+namespace kaleidoscope
+{
+namespace plugin
+{
+
+class HfclkArbiter : public Plugin
+{
+  public:
+    EventHandlerResult onFocusEvent(const char *command);
+};
+
+} // namespace plugin
+} // namespace kaleidoscope
+
+extern kaleidoscope::plugin::HfclkArbiter HfclkArbiter;
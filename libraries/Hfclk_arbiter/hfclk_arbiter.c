@@ -0,0 +1,157 @@
+/* -*- mode: c++ -*-
+ * hfclk_arbiter -- Reference-counted requests of the HFXO crystal
+ * Copyright (C) 2020  Dygma Lab S.L.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "hfclk_arbiter.h"
+
+#include "Arduino.h"
+#include "app_util_platform.h"
+#include "nrf_clock.h"
+#include "nrf_drv_clock.h"
+#include "nrf_sdh.h"
+#include "nrf_soc.h"
+#include "nrfx_power.h"
+
+// The power event handler of the TinyUSB nrf5x port, see -Wl,--wrap in the Makefile.
+void __real_tusb_hal_nrf_power_event(uint32_t event);
+
+static bool requested[HFCLK_USER_COUNT];
+static uint32_t request_count[HFCLK_USER_COUNT];
+static uint32_t on_time_ms[HFCLK_USER_COUNT];
+static uint32_t ti_request_ms[HFCLK_USER_COUNT];
+static uint8_t ref_count = 0;
+
+static uint32_t now_ms(void)
+{
+    return millis();
+}
+
+void hfclk_arbiter_request(hfclk_user_t user)
+{
+    CRITICAL_REGION_ENTER();
+
+    if (!requested[user])
+    {
+        requested[user] = true;
+        request_count[user]++;
+        ti_request_ms[user] = now_ms();
+
+        if (ref_count++ == 0)
+        {
+            if (!nrf_drv_clock_init_check())
+            {
+                nrf_drv_clock_init();
+            }
+            nrf_drv_clock_hfclk_request(NULL);
+        }
+    }
+
+    CRITICAL_REGION_EXIT();
+}
+
+void hfclk_arbiter_release(hfclk_user_t user)
+{
+    CRITICAL_REGION_ENTER();
+
+    if (requested[user])
+    {
+        requested[user] = false;
+        on_time_ms[user] += now_ms() - ti_request_ms[user];
+
+        if (--ref_count == 0)
+        {
+            nrf_drv_clock_hfclk_release();
+        }
+    }
+
+    CRITICAL_REGION_EXIT();
+}
+
+bool hfclk_arbiter_is_requested(hfclk_user_t user)
+{
+    return requested[user];
+}
+
+uint8_t hfclk_arbiter_ref_count(void)
+{
+    return ref_count;
+}
+
+uint32_t hfclk_arbiter_on_time_ms(hfclk_user_t user)
+{
+    uint32_t time = on_time_ms[user];
+    if (requested[user])
+    {
+        time += now_ms() - ti_request_ms[user];
+    }
+
+    return time;
+}
+
+uint32_t hfclk_arbiter_request_count(hfclk_user_t user)
+{
+    return request_count[user];
+}
+
+void hfclk_arbiter_rf_start(void)
+{
+    hfclk_arbiter_request(HFCLK_USER_RF);
+}
+
+void hfclk_arbiter_rf_stop(void)
+{
+    hfclk_arbiter_release(HFCLK_USER_RF);
+}
+
+/*
+    The USB stack starts the crystal on VBUS detected and stops it on VBUS removed by itself,
+    through the SoftDevice or the CLOCK tasks, whoever else is using it. Its power events are
+    wrapped to hold the USB request here, and to start the crystal again after the stop if
+    another user still holds a request.
+*/
+void __wrap_tusb_hal_nrf_power_event(uint32_t event)
+{
+    __real_tusb_hal_nrf_power_event(event);
+
+    switch (event)
+    {
+        case NRFX_POWER_USB_EVT_DETECTED:
+            hfclk_arbiter_request(HFCLK_USER_USB);
+            break;
+
+        case NRFX_POWER_USB_EVT_REMOVED:
+            hfclk_arbiter_release(HFCLK_USER_USB);
+
+            CRITICAL_REGION_ENTER();
+            if (ref_count > 0)
+            {
+                if (nrf_sdh_is_enabled())
+                {
+                    sd_clock_hfclk_request();
+                }
+                else
+                {
+                    nrf_clock_task_trigger(NRF_CLOCK_TASK_HFCLKSTART);
+                }
+            }
+            CRITICAL_REGION_EXIT();
+            break;
+
+        default:
+            break;
+    }
+}
@@ -0,0 +1,57 @@
+/* -*- mode: c++ -*-
+ * hfclk_arbiter -- Reference-counted requests of the HFXO crystal
+ * Copyright (C) 2020  Dygma Lab S.L.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __HFCLK_ARBITER_H__
+#define __HFCLK_ARBITER_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*
+    Every user holds at most one request. The crystal is started by the first request and
+    stopped with the last release, through nrf_drv_clock, which goes through the SoftDevice
+    while it is enabled.
+*/
+typedef enum
+{
+    HFCLK_USER_RF,            // rf_host_device, through its clock callbacks.
+    HFCLK_USER_USB,           // USBD, from VBUS detected to VBUS removed.
+    HFCLK_USER_COUNT,
+} hfclk_user_t;
+
+void hfclk_arbiter_request(hfclk_user_t user);
+void hfclk_arbiter_release(hfclk_user_t user);
+bool hfclk_arbiter_is_requested(hfclk_user_t user);
+uint8_t hfclk_arbiter_ref_count(void);
+uint32_t hfclk_arbiter_on_time_ms(hfclk_user_t user);  // Time requested by the user since boot.
+uint32_t hfclk_arbiter_request_count(hfclk_user_t user);
+
+// Clock callbacks for rf_host_device.
+void hfclk_arbiter_rf_start(void);
+void hfclk_arbiter_rf_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HFCLK_ARBITER_H__ */
@@ -26,3 +26,4 @@ THE SOFTWARE.
 #include "HIDReportObserver.h"
 
 HIDReportObserver::SendReportHook HIDReportObserver::send_report_hook_ = nullptr;
+HIDReportObserver::SentReportHook HIDReportObserver::sent_report_hook_ = nullptr;
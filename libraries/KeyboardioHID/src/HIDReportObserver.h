@@ -50,7 +50,24 @@ class HIDReportObserver {
     return previous_hook;
   }
 
+  // Called each time a queued report is handed to the USB or BLE stack, success is false when
+  // the stack refused it. latency_us is the time the report waited in the queue.
+  typedef void(*SentReportHook)(uint8_t id, int len, bool ble, bool success, uint32_t latency_us);
+
+  static void observeSentReport(uint8_t id, int len, bool ble, bool success, uint32_t latency_us) {
+    if (sent_report_hook_) {
+      (*sent_report_hook_)(id, len, ble, success, latency_us);
+    }
+  }
+
+  static SentReportHook resetSentHook(SentReportHook new_hook) {
+    auto previous_hook = sent_report_hook_;
+    sent_report_hook_ = new_hook;
+    return previous_hook;
+  }
+
  private:
 
   static SendReportHook send_report_hook_;
+  static SentReportHook sent_report_hook_;
 };
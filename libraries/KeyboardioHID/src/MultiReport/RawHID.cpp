@@ -28,6 +28,7 @@
 #include "Ble_composite_dev.h"
 #include "ble_hid_service.h"
 #include "hidDefy.h"
+#include "HIDReportObserver.h"
 
 tu_fifo_t rx_ff;
 tu_fifo_t tx_ff;
@@ -59,18 +60,36 @@ size_t RawHID_::read(uint8_t *buffer, size_t size)
 void RawHID_::flush(void)
 {
     if(!ble_connected()) return;
-    uint16_t size = tu_fifo_count(&tx_ff);
-    if (size ==0) return;
     uint8_t buff[INPUT_REPORT_LEN_RAW];
-    memset(buff,0,INPUT_REPORT_LEN_RAW);
-    uint16_t i = tu_fifo_peek_n(&tx_ff, buff, INPUT_REPORT_LEN_RAW);
-    if (i != 0)
+    //Send reports until the fifo is empty or the BLE stack has no room left, so several
+    //notifications can go in the same connection event.
+    while (tu_fifo_count(&tx_ff) != 0)
     {
-        if (ble_send_report(HID_REPORTID_RAWHID, buff, INPUT_REPORT_LEN_RAW)){
-            tu_fifo_advance_read_pointer(&tx_ff, i);
+        memset(buff,0,INPUT_REPORT_LEN_RAW);
+        uint16_t i = tu_fifo_peek_n(&tx_ff, buff, INPUT_REPORT_LEN_RAW);
+        if (i == 0)
+        {
+            break;
         }
+        bool success = ble_send_report(HID_REPORTID_RAWHID, buff, INPUT_REPORT_LEN_RAW);
+        //A report retried in later calls is only reported once as failed.
+        if (success || !head_failed_)
+        {
+            HIDReportObserver::observeSentReport(HID_REPORTID_RAWHID, INPUT_REPORT_LEN_RAW, true, success, 0);
+        }
+        head_failed_ = !success;
+        if (!success)
+        {
+            break;
+        }
+        tu_fifo_advance_read_pointer(&tx_ff, i);
+        ble_bytes_sent_ += i;
     }
-    //Send report each time
+}
+
+uint16_t RawHID_::pendingWrite(void)
+{
+    return tu_fifo_count(&tx_ff);
 }
 
 size_t RawHID_::write(uint8_t ch)
@@ -33,6 +33,15 @@ public:
   virtual int availableForWrite(void);
   using Print::write; // pull in write(str) from Print
 
+  // Bytes waiting to be sent over BLE.
+  uint16_t pendingWrite(void);
+  // Payload bytes sent over BLE since boot.
+  uint32_t bleBytesSent(void) { return ble_bytes_sent_; }
+
+private:
+  uint32_t ble_bytes_sent_ = 0;
+  bool head_failed_ = false;  // The report at the head of the queue already failed once.
+
 };
 
 
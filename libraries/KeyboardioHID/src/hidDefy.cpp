@@ -62,8 +62,21 @@ struct NextReport
 {
     uint8_t id;
     uint16_t len;
+    uint32_t enqueue_us;  // Used to measure the time spent in the queue.
 };
 
+// Last report of each id, replayed when the transport changes.
+#define HID_LAST_REPORT_IDS     (HID_REPORTID_SYSTEMCONTROL + 1)
+#define HID_LAST_REPORT_LEN_MAX 32
+
+struct LastReport
+{
+    uint8_t len;
+    uint8_t data[HID_LAST_REPORT_LEN_MAX];
+};
+
+static LastReport last_reports[HID_LAST_REPORT_IDS];
+
 int HID_::SendReport_(uint8_t id, const void *data, int len)
 {
     /* On SAMD, we need to send the whole report in one batch; sending the id, and
@@ -100,7 +113,13 @@ int HID_::SendReport_(uint8_t id, const void *data, int len)
     }
     else if (TinyUSBDevice.mounted() || ble_connected())
     {
-        NextReport nextReport{id, static_cast<uint16_t>(len)};
+        if (id < HID_LAST_REPORT_IDS && len <= HID_LAST_REPORT_LEN_MAX)
+        {
+            last_reports[id].len = len;
+            memcpy(last_reports[id].data, data, len);
+        }
+
+        NextReport nextReport{id, static_cast<uint16_t>(len), static_cast<uint32_t>(micros())};
         tu_fifo_write_n(&tx_ff_hid, &nextReport, (uint16_t)(sizeof(nextReport)));
         tu_fifo_write_n(&tx_ff_hid, data, (uint16_t)len);
     }
@@ -116,7 +135,12 @@ int HID_::SendReport_(uint8_t id, const void *data, int len)
 bool HID_::SendLastReport()
 {
     bool success = true;
-    if (tu_fifo_count(&tx_ff_hid) != 0)
+    /*
+        Over BLE the queue is drained into the SoftDevice notification buffers until they are full
+        (ble_send_report fails with NRF_ERROR_RESOURCES), so several reports share one connection
+        event. USB has a single endpoint buffer, so only one report is sent per call.
+    */
+    while (tu_fifo_count(&tx_ff_hid) != 0)
     {
         struct
         {
@@ -126,19 +150,107 @@ bool HID_::SendLastReport()
         tu_fifo_peek_n(&tx_ff_hid, &nextReportWithData.nextReport, (uint16_t)(sizeof(nextReportWithData.nextReport)));
         tu_fifo_peek_n(&tx_ff_hid, &nextReportWithData, (uint16_t)(sizeof(nextReportWithData.nextReport)) + nextReportWithData.nextReport.len);
 
-        if (ble_connected())
-            success = ble_send_report(nextReportWithData.nextReport.id, (uint8_t *const)nextReportWithData.dataReport, nextReportWithData.nextReport.len);
+        bool over_ble = overBle();
+        success = sendNow(over_ble, nextReportWithData.nextReport.id, nextReportWithData.dataReport, nextReportWithData.nextReport.len);
+
+        // A report retried in later calls is only reported once as failed.
+        if (success || !head_failed)
+        {
+            uint32_t latency_us = static_cast<uint32_t>(micros()) - nextReportWithData.nextReport.enqueue_us;
+            HIDReportObserver::observeSentReport(nextReportWithData.nextReport.id, nextReportWithData.nextReport.len, over_ble, success, latency_us);
+        }
+
+        // Reports for a transport that is down are dropped.
+        bool path_down;
+        if (host_path == HOST_PATH_AUTO)
+            path_down = (ble_innited() && !ble_connected()) || (!ble_innited() && TinyUSBDevice.suspended());
+        else if (over_ble)
+            path_down = !ble_connected();
         else
-            success = usb_hid.sendReport(nextReportWithData.nextReport.id, nextReportWithData.dataReport, nextReportWithData.nextReport.len);
+            path_down = !TinyUSBDevice.mounted() || TinyUSBDevice.suspended();
 
-        if (success || (ble_innited() && !ble_connected()) || (!ble_innited() && TinyUSBDevice.suspended()))
+        if (success || path_down)
         {
             tu_fifo_advance_read_pointer(&tx_ff_hid, (uint16_t)(sizeof(nextReportWithData.nextReport)) + nextReportWithData.nextReport.len);
+            head_failed = false;
+        }
+        else
+        {
+            head_failed = true;
+        }
+
+        // On failure the same report is retried in the next call.
+        if (!success || !over_ble)
+        {
+            break;
         }
     }
     return success;
 }
 
+bool HID_::hasPendingReports()
+{
+    return tu_fifo_count(&tx_ff_hid) != 0;
+}
+
+bool HID_::overBle()
+{
+    switch (host_path)
+    {
+        case HOST_PATH_USB:
+            return false;
+        case HOST_PATH_BLE:
+            return true;
+        default:
+            return ble_connected();
+    }
+}
+
+bool HID_::sendNow(bool over_ble, uint8_t id, const uint8_t *data, uint8_t len)
+{
+    if (over_ble)
+        return ble_send_report(id, (uint8_t *const)data, len);
+
+    return usb_hid.sendReport(id, data, len);
+}
+
+void HID_::switchHostPath(HostPath path)
+{
+    bool old_ble = overBle();
+    bool old_up = old_ble ? ble_connected() : (TinyUSBDevice.mounted() && !TinyUSBDevice.suspended());
+
+    host_path = path;
+    bool new_ble = overBle();
+    if (new_ble == old_ble)
+    {
+        return;
+    }
+
+    uint8_t empty[HID_LAST_REPORT_LEN_MAX] = {};
+    for (uint8_t id = 0; id < HID_LAST_REPORT_IDS; id++)
+    {
+        LastReport &report = last_reports[id];
+        if (report.len == 0 || memcmp(report.data, empty, report.len) == 0)
+        {
+            continue;
+        }
+
+        // Best effort, the old host may not be listening anymore.
+        if (old_up)
+        {
+            sendNow(old_ble, id, empty, report.len);
+        }
+
+        // A mouse report carries relative motion, replaying it would move the pointer.
+        if (id != HID_REPORTID_MOUSE)
+        {
+            NextReport nextReport{id, report.len, static_cast<uint32_t>(micros())};
+            tu_fifo_write_n(&tx_ff_hid, &nextReport, (uint16_t)(sizeof(nextReport)));
+            tu_fifo_write_n(&tx_ff_hid, report.data, (uint16_t)report.len);
+        }
+    }
+}
+
 
 enum
 {
@@ -79,6 +79,13 @@ enum {
   RID_CONSUMER_CONTROL, // Media, volume etc ..
 };
 
+// Transport of the HID reports. HOST_PATH_AUTO uses BLE while it is connected, USB otherwise.
+enum HostPath : uint8_t {
+  HOST_PATH_AUTO,
+  HOST_PATH_USB,
+  HOST_PATH_BLE,
+};
+
 class HID_ {
  public:
 
@@ -86,6 +93,7 @@ class HID_ {
   int begin();
   int SendReport(uint8_t id, const void* data, int len);
   bool SendLastReport();
+  bool hasPendingReports();
   void AppendDescriptor(HIDSubDescriptor* node);
 
   uint8_t getLEDs() {
@@ -94,8 +102,24 @@ class HID_ {
 
   uint8_t getShortName(char *name);
   int SendReport_(uint8_t id, const void* data, int len);
+
+  /*
+    Moves the reports to another transport. The keys held on the old one are released there,
+    if it is still up, and the current state of the keyboard, consumer and system reports is
+    sent again on the new one, so no key gets stuck on either host.
+  */
+  void switchHostPath(HostPath path);
+  HostPath hostPath() {
+    return host_path;
+  };
+
   Adafruit_USBD_HID usb_hid;
 private:
+  HostPath host_path = HOST_PATH_AUTO;
+  bool head_failed = false;  // The report at the head of the queue already failed once.
+  bool overBle();
+  bool sendNow(bool over_ble, uint8_t id, const uint8_t *data, uint8_t len);
+
   char keyboarName[20] = "Defy RP2040";
 //  std::vector<uint8_t> descriptor;
 
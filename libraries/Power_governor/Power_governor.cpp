@@ -0,0 +1,204 @@
+/* -*- mode: c++ -*-
+ * kaleidoscope::plugin::PowerGovernor -- Scale the power hungry activities with the battery level
+ * Copyright (C) 2020  Dygma Lab S.L.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "Power_governor.h"
+
+#include "Battery.h"
+#include "Ble_manager.h"
+#include "Kaleidoscope-EEPROM-Settings.h"
+#include "Kaleidoscope-FocusSerial.h"
+#include "Radio_manager.h"
+
+namespace kaleidoscope
+{
+namespace plugin
+{
+
+#define POWER_GOVERNOR_EVAL_MS      1000
+#define POWER_GOVERNOR_HYSTERESIS   5     // Percent above the threshold of a tier to go back to it.
+#define POWER_GOVERNOR_BATTERY_MAH  1000  // Model capacity of a side, for the runtime projection.
+
+#define BATTERY_STATUS_NOT_CHARGING 0
+#define BATTERY_STATUS_DISCONNECTED 4
+
+/*
+    The model currents are estimates of a side in each tier, with the saving mode dimming its
+    LEDs, to compare the tiers with each other. They are not measurements.
+*/
+const PowerGovernor::TierProfile PowerGovernor::profiles[TIER_COUNT] = {
+    // min_level, ble_idle_timeout_ms, rf_power_ceiling, sides_saving, model_current_ma
+    {50, UINT16_MAX, 2, false, 30},  // TIER_FULL
+    {20, 2000, 2, false, 22},        // TIER_BALANCED
+    {8, 1000, 1, true, 10},          // TIER_SAVER
+    {0, 1000, 0, true, 5},           // TIER_CRITICAL
+};
+
+void PowerGovernor::reserve_settings(void)
+{
+    settings_base_ = kaleidoscope::plugin::EEPROMSettings::requestSlice(sizeof(enabled));
+    Runtime.storage().get(settings_base_, enabled);
+    if (enabled == 0xFF)
+    {
+        enabled = 1;
+        Runtime.storage().put(settings_base_, enabled);
+        Runtime.storage().commit();
+    }
+}
+
+EventHandlerResult PowerGovernor::beforeEachCycle()
+{
+    if (!Runtime.hasTimeExpired(ti_eval, static_cast<uint32_t>(POWER_GOVERNOR_EVAL_MS)))
+    {
+        return EventHandlerResult::OK;
+    }
+    ti_eval = Runtime.millisAtCycleStart();
+
+    eval();
+
+    return EventHandlerResult::OK;
+}
+
+void PowerGovernor::eval(void)
+{
+    level = 100;
+    on_battery = false;
+
+    uint8_t status[2] = {::Battery.getStatusLeft(), ::Battery.getStatusRight()};
+    uint8_t levels[2] = {::Battery.getBatteryLevelLeft(), ::Battery.getBatteryLevelRight()};
+    for (uint8_t i = 0; i < 2; i++)
+    {
+        if (status[i] == BATTERY_STATUS_NOT_CHARGING)
+        {
+            on_battery = true;
+            level = min(level, levels[i]);
+        }
+    }
+
+    Tier new_tier = enabled ? tier_for_level() : TIER_FULL;
+    if (::Battery.isSavingMode() && new_tier < TIER_SAVER)
+    {
+        new_tier = TIER_SAVER;
+    }
+
+    if (new_tier != tier)
+    {
+        apply(new_tier);
+    }
+}
+
+PowerGovernor::Tier PowerGovernor::tier_for_level(void)
+{
+    // The chargers and the disconnected sides do not count, and a keyboard without a side on battery runs at full power.
+    if (!on_battery)
+    {
+        return TIER_FULL;
+    }
+
+    uint8_t raw = TIER_CRITICAL;
+    while (raw > TIER_FULL && level >= profiles[raw - 1].min_level)
+    {
+        raw--;
+    }
+    if (raw >= tier)
+    {
+        return static_cast<Tier>(raw);  // Going down is immediate.
+    }
+
+    uint8_t up = TIER_CRITICAL;
+    while (up > TIER_FULL && level >= profiles[up - 1].min_level + POWER_GOVERNOR_HYSTERESIS)
+    {
+        up--;
+    }
+
+    return static_cast<Tier>(min(up, static_cast<uint8_t>(tier)));
+}
+
+void PowerGovernor::apply(Tier new_tier)
+{
+    NRF_LOG_INFO("Power_governor: tier %u -> %u, battery %u%%%s.", tier, new_tier, level, on_battery ? "" : " (charging)");
+
+    tier = new_tier;
+    tier_changes++;
+    ti_tier_change = Runtime.millisAtCycleStart();
+
+    TierProfile const &profile = profiles[tier];
+    RadioManager::setPowerCeiling(profile.rf_power_ceiling);
+    ::BleManager.set_idle_timeout_limit(profile.ble_idle_timeout_ms);
+    ::Battery.setGovernorSaving(profile.sides_saving);
+}
+
+uint32_t PowerGovernor::projected_minutes(Tier for_tier)
+{
+    return static_cast<uint32_t>(POWER_GOVERNOR_BATTERY_MAH) * level * 60 / (100 * profiles[for_tier].model_current_ma);
+}
+
+EventHandlerResult PowerGovernor::onFocusEvent(const char *command)
+{
+    if (::Focus.handleHelp(command, "power.governor\npower.governorStats\npower.runtime")) return EventHandlerResult::OK;
+
+    if (strncmp(command, "power.", 6) != 0) return EventHandlerResult::OK;
+
+    if (strcmp(command + 6, "governor") == 0)
+    {
+        if (::Focus.isEOL())
+        {
+            ::Focus.send(enabled);
+        }
+        else
+        {
+            uint8_t value;
+            ::Focus.read(value);
+            enabled = value ? 1 : 0;
+            Runtime.storage().put(settings_base_, enabled);
+            Runtime.storage().commit();
+            eval();
+        }
+        return EventHandlerResult::EVENT_CONSUMED;
+    }
+
+    // Tier (0 full to 3 critical), level used, side on battery, tier changes, seconds since the last change.
+    if (strcmp(command + 6, "governorStats") == 0)
+    {
+        if (::Focus.isEOL())
+        {
+            ::Focus.send(static_cast<uint8_t>(tier), level, static_cast<uint8_t>(on_battery), tier_changes);
+            ::Focus.send((Runtime.millisAtCycleStart() - ti_tier_change) / 1000);
+        }
+        return EventHandlerResult::EVENT_CONSUMED;
+    }
+
+    // Projection of each tier from the current level: model current in mA, then runtime in minutes.
+    if (strcmp(command + 6, "runtime") == 0)
+    {
+        if (::Focus.isEOL())
+        {
+            for (uint8_t i = 0; i < TIER_COUNT; i++)
+            {
+                ::Focus.send(profiles[i].model_current_ma, projected_minutes(static_cast<Tier>(i)));
+            }
+        }
+        return EventHandlerResult::EVENT_CONSUMED;
+    }
+
+    return EventHandlerResult::OK;
+}
+
+} // namespace plugin
+} // namespace kaleidoscope
+
+kaleidoscope::plugin::PowerGovernor PowerGovernor;
@@ -0,0 +1,91 @@
+/* -*- mode: c++ -*-
+ * kaleidoscope::plugin::PowerGovernor -- Scale the power hungry activities with the battery level
+ * Copyright (C) 2020  Dygma Lab S.L.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "kaleidoscope/Runtime.h"
+#include "kaleidoscope/plugin.h"
+#include <Arduino.h>
+
+namespace kaleidoscope
+{
+namespace plugin
+{
+
+/*
+    Chooses a power tier from the battery of the sides (the lowest one not on the charger) and
+    the saving mode setting, and applies it:
+    - BLE: shorter idle timeout before the idle connection parameters.
+    - RF: ceiling of the TX power chosen with wireless.rf.power.
+    - Sides: saving mode, which dims and slows down their LED effects and their key scan.
+    A tier is left towards a higher one only once the level is POWER_GOVERNOR_HYSTERESIS above
+    its threshold, so a noisy level does not make it toggle.
+*/
+class PowerGovernor : public Plugin
+{
+  public:
+    enum Tier : uint8_t
+    {
+        TIER_FULL,
+        TIER_BALANCED,
+        TIER_SAVER,
+        TIER_CRITICAL,
+        TIER_COUNT,
+    };
+
+    EventHandlerResult beforeEachCycle();
+    EventHandlerResult onFocusEvent(const char *command);
+
+    // Requests the enable slice, from setup() after the other settings added to the layout.
+    void reserve_settings(void);
+
+    Tier getTier(void)
+    {
+        return tier;
+    }
+
+  private:
+    struct TierProfile
+    {
+        uint8_t min_level;  // Lowest battery level of the tier, in percent.
+        uint16_t ble_idle_timeout_ms;
+        uint8_t rf_power_ceiling;
+        bool sides_saving;
+        uint16_t model_current_ma;  // Estimated draw of a side, for the runtime projection.
+    };
+    static const TierProfile profiles[TIER_COUNT];
+
+    uint8_t enabled = 1;
+    uint16_t settings_base_ = 0;
+    Tier tier = TIER_FULL;
+    uint8_t level = 100;      // Lowest level of the sides running from the battery.
+    bool on_battery = false;  // At least one connected side is not on the charger.
+    uint32_t ti_eval = 0;
+    uint16_t tier_changes = 0;
+    uint32_t ti_tier_change = 0;
+
+    void eval(void);
+    Tier tier_for_level(void);
+    void apply(Tier new_tier);
+    uint32_t projected_minutes(Tier for_tier);
+};
+
+} // namespace plugin
+} // namespace kaleidoscope
+
+extern kaleidoscope::plugin::PowerGovernor PowerGovernor;
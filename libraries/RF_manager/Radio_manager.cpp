@@ -33,6 +33,8 @@ namespace plugin
 uint16_t RadioManager::settings_base_ = 0;
 bool RadioManager::inited = false;
 RadioManager::Power RadioManager::power_rf = LOW_P;
+RadioManager::Power RadioManager::power_level = LOW_P;
+RadioManager::Power RadioManager::power_ceiling = HIGH_P;
 uint16_t RadioManager::channel_hop;
 EventHandlerResult RadioManager::onSetup()
 {
@@ -44,6 +46,8 @@ EventHandlerResult RadioManager::onSetup()
         Runtime.storage().put(settings_base_, power_rf);
         Runtime.storage().commit();
     }
+
+    reset_power_level();
     return EventHandlerResult::OK;
 }
 
@@ -63,7 +67,7 @@ void RadioManager::init()
 void RadioManager::setPowerRF()
 {
     if (!inited) return;
-    switch (power_rf)
+    switch (power_level)
     {
         case LOW_P:
             rfgw_tx_power_set(RFGW_TX_POWER_0_DBM);
@@ -77,6 +81,21 @@ void RadioManager::setPowerRF()
     }
 }
 
+void RadioManager::reset_power_level()
+{
+    power_level = min(power_rf, power_ceiling);
+}
+
+void RadioManager::setPowerCeiling(uint8_t ceiling)
+{
+    Power new_ceiling = static_cast<Power>(min(ceiling, static_cast<uint8_t>(HIGH_P)));
+    if (new_ceiling == power_ceiling) return;
+    power_ceiling = new_ceiling;
+
+    reset_power_level();
+    setPowerRF();
+}
+
 EventHandlerResult RadioManager::onFocusEvent(const char *command)
 {
     if (::Focus.handleHelp(command, "wireless.rf.power\nwireless.rf.channelHop\nwireless.rf.syncPairing")) return EventHandlerResult::OK;
@@ -98,6 +117,7 @@ EventHandlerResult RadioManager::onFocusEvent(const char *command)
             if (power <= HIGH_P)
             {
                 power_rf = (RadioManager::Power)power;
+                reset_power_level();
                 setPowerRF();
                 Runtime.storage().put(settings_base_, power_rf);
                 Runtime.storage().commit();
@@ -34,6 +34,9 @@ class RadioManager : public Plugin {
     EventHandlerResult onSetup();
     static void init();
     static void poll();
+
+    // Highest TX power allowed (0 low, 1 medium, 2 high), set by the PowerGovernor from the battery level.
+    static void setPowerCeiling(uint8_t ceiling);
     EventHandlerResult onFocusEvent(const char *command);
 
     static bool isEnabled();
@@ -48,6 +51,9 @@ class RadioManager : public Plugin {
     static bool inited;
     static uint16_t channel_hop;
     static Power power_rf;
+    static Power power_level;  // Level in use, the one chosen by the user limited by the ceiling.
+    static Power power_ceiling;
+    static void reset_power_level();
     static uint16_t settings_base_;
     static void setPowerRF();
 };
@@ -0,0 +1,254 @@
+/* -*- mode: c++ -*-
+ * kaleidoscope::plugin::SleepController -- Idle the MCU between events
+ * Copyright (C) 2020  Dygma Lab S.L.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "Sleep_controller.h"
+
+#include "Flash_arbiter.h"
+#include "Kaleidoscope-FocusSerial.h"
+#include "MultiReport/RawHID.h"
+#include "Radio_manager.h"
+#include "SpiPort.h"
+#include "hidDefy.h"
+#include "kaleidoscope/plugin/LEDControlDefy.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "app_timer.h"
+#include "nrf_clock.h"
+#include "nrf_sdh.h"
+#include "nrf_soc.h"
+#include "sdk_config.h"
+#include "tusb.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+#define SLEEP_ACTIVE_WAKE_MS    10    // LED effect frames and key timeouts.
+#define SLEEP_KEY_TIMEOUTS_MS   3000  // Longer than the OneShot, Qukeys and SuperKeys timeouts.
+#define SLEEP_IDLE_WAKE_MS      (NRFX_WDT_CONFIG_RELOAD_VALUE / 2)
+
+APP_TIMER_DEF(sleep_wake_timer);
+
+static void sleep_wake_handler(void *p_context)
+{
+    // Nothing to do, the interrupt has already ended the sleep.
+}
+
+/*
+    app_timer_init() is called by the BLE stack, so in wired mode RTC1 may never have been started
+    and a wake-up timer would never fire. RTC1 counts once its interrupt is enabled by app_timer_init()
+    and the LFCLK runs, which the SoftDevice guarantees while it is enabled.
+*/
+static bool wake_timer_running(void)
+{
+    if (!NVIC_GetEnableIRQ(RTC1_IRQn)) return false;
+    if (nrf_sdh_is_enabled()) return true;
+
+    return nrf_clock_lf_is_running();
+}
+
+namespace kaleidoscope
+{
+namespace plugin
+{
+
+EventHandlerResult SleepController::onSetup()
+{
+    wake_timer_ready = (app_timer_create(&sleep_wake_timer, APP_TIMER_MODE_SINGLE_SHOT, sleep_wake_handler) == NRF_SUCCESS);
+
+    return EventHandlerResult::OK;
+}
+
+EventHandlerResult SleepController::beforeEachCycle()
+{
+    if (woken)
+    {
+        woken = false;
+
+        uint32_t service_us = micros() - ti_wake_us;
+        wake_service_sum_us += service_us;
+        if (service_us > wake_service_max_us) wake_service_max_us = service_us;
+    }
+
+    return EventHandlerResult::OK;
+}
+
+EventHandlerResult SleepController::onKeyswitchEvent(Key &mapped_key, KeyAddr key_addr, uint8_t key_state)
+{
+    if (keyIsPressed(key_state) || keyWasPressed(key_state))
+    {
+        ti_key_activity = millis();
+    }
+
+    return EventHandlerResult::OK;
+}
+
+void SleepController::postpone(Client client, uint32_t time_ms)
+{
+    if (time_ms == 0)
+    {
+        awake_once |= (1 << client);
+        return;
+    }
+
+    uint32_t until = millis() + time_ms;
+    if (static_cast<int32_t>(until - ti_awake_until[client]) > 0)
+    {
+        ti_awake_until[client] = until;
+    }
+}
+
+SleepController::Client SleepController::busy_client(void)
+{
+    uint32_t now = millis();
+    for (uint8_t i = 0; i < CLIENT_COUNT; i++)
+    {
+        if ((awake_once & (1 << i)) || static_cast<int32_t>(ti_awake_until[i] - now) > 0)
+        {
+            return static_cast<Client>(i);
+        }
+    }
+
+#ifdef USE_TINYUSB
+    if (tud_task_event_ready()) return CLIENT_USB;
+#endif
+
+    // The RF gateway polls its radio from loop() and has no way to tell us its next deadline.
+    if (RadioManager::isInited()) return CLIENT_RF;
+
+    if (SpiPort::rxPending()) return CLIENT_SPI;
+    if (FlashArbiter.busy()) return CLIENT_FLASH;
+    if (HID().hasPendingReports() || RawHID.pendingWrite() != 0) return CLIENT_HID;
+
+    return CLIENT_COUNT;
+}
+
+void SleepController::run(void)
+{
+    Client client = busy_client();
+    awake_once = 0;
+
+    if (!enabled) return;
+
+    if (client != CLIENT_COUNT)
+    {
+        blocked[client]++;
+        return;
+    }
+
+    sleep();
+}
+
+uint32_t SleepController::wake_after_ms(void)
+{
+    if (LEDControl::isEnabled() || millis() - ti_key_activity < SLEEP_KEY_TIMEOUTS_MS)
+    {
+        return SLEEP_ACTIVE_WAKE_MS;
+    }
+
+    return SLEEP_IDLE_WAKE_MS;
+}
+
+void SleepController::sleep(void)
+{
+    // Without the wake-up timer nothing would end the sleep in time for the watchdog.
+    if (!wake_timer_ready || !wake_timer_running()) return;
+    if (app_timer_start(sleep_wake_timer, APP_TIMER_TICKS(wake_after_ms()), nullptr) != NRF_SUCCESS) return;
+
+    uint32_t ti_sleep_us = micros();
+
+    if (nrf_sdh_is_enabled())
+    {
+        sd_app_evt_wait();
+    }
+    else
+    {
+        // Even if we miss an event enabling USB, USB event would wake us up.
+        __WFE();
+        // Clear SEV flag if CPU was woken up by event.
+        __SEV();
+        __WFE();
+    }
+
+    app_timer_stop(sleep_wake_timer);
+
+    ti_wake_us = micros();
+    woken = true;
+    sleeps++;
+    sleep_total_us += ti_wake_us - ti_sleep_us;
+}
+
+EventHandlerResult SleepController::onFocusEvent(const char *command)
+{
+    if (::Focus.handleHelp(command, "power.sleep\npower.sleepStats")) return EventHandlerResult::OK;
+
+    if (strncmp(command, "power.", 6) != 0) return EventHandlerResult::OK;
+
+    if (strcmp(command + 6, "sleep") == 0)
+    {
+        if (::Focus.isEOL())
+        {
+            ::Focus.send(enabled);
+        }
+        else
+        {
+            ::Focus.read(enabled);
+        }
+        return EventHandlerResult::EVENT_CONSUMED;
+    }
+
+    /*
+        Sleeps, ms asleep, avg and max wake-to-service us, then the loops kept awake by each client:
+        RF, USB, SPI, flash, HID, log. Any argument resets them.
+    */
+    if (strcmp(command + 6, "sleepStats") == 0)
+    {
+        if (::Focus.isEOL())
+        {
+            uint32_t wake_service_avg_us = sleeps ? static_cast<uint32_t>(wake_service_sum_us / sleeps) : 0;
+            ::Focus.send(sleeps, static_cast<uint32_t>(sleep_total_us / 1000), wake_service_avg_us, wake_service_max_us);
+            for (auto count : blocked)
+            {
+                ::Focus.send(count);
+            }
+        }
+        else
+        {
+            uint8_t reset;
+            ::Focus.read(reset);
+            sleeps = 0;
+            sleep_total_us = 0;
+            wake_service_sum_us = 0;
+            wake_service_max_us = 0;
+            memset(blocked, 0, sizeof(blocked));
+        }
+        return EventHandlerResult::EVENT_CONSUMED;
+    }
+
+    // The rest of power.* belongs to other plugins.
+    return EventHandlerResult::OK;
+}
+
+} // namespace plugin
+} // namespace kaleidoscope
+
+kaleidoscope::plugin::SleepController SleepController;
@@ -0,0 +1,89 @@
+/* -*- mode: c++ -*-
+ * kaleidoscope::plugin::SleepController -- Idle the MCU between events
+ * Copyright (C) 2020  Dygma Lab S.L.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "kaleidoscope/Runtime.h"
+#include "kaleidoscope/plugin.h"
+#include <Arduino.h>
+
+namespace kaleidoscope
+{
+namespace plugin
+{
+
+/*
+    At the end of each loop() the MCU waits for the next interrupt (System ON idle), unless one
+    of the clients needs the CPU: the RF gateway is running, USB has events to process,
+    the SPI ports have packets, a flash operation is running, or the HID queues or the log have
+    data to send. The side packets, USB and the radio wake the CPU with their interrupts.
+
+    The Kaleidoscope timeouts (Qukeys, OneShot, SuperKeys, MouseKeys) and the LED effects have no
+    interrupt, they are polled by each cycle, so an app_timer bounds every sleep: SLEEP_ACTIVE_WAKE_MS
+    while the LEDs are on or a key was used in the last SLEEP_KEY_TIMEOUTS_MS, SLEEP_IDLE_WAKE_MS
+    otherwise, well within the watchdog reload value as the watchdog keeps running during the sleep.
+    The timer needs RTC1, started by the BLE stack; until then the MCU does not sleep.
+*/
+class SleepController : public Plugin
+{
+  public:
+    enum Client : uint8_t
+    {
+        CLIENT_RF,
+        CLIENT_USB,
+        CLIENT_SPI,
+        CLIENT_FLASH,
+        CLIENT_HID,
+        CLIENT_LOG,
+        CLIENT_COUNT,
+    };
+
+    EventHandlerResult onSetup();
+    EventHandlerResult beforeEachCycle();
+    EventHandlerResult onKeyswitchEvent(Key &mapped_key, KeyAddr key_addr, uint8_t key_state);
+    EventHandlerResult onFocusEvent(const char *command);
+
+    // Keep the CPU awake for time_ms, or for the current loop() with 0. Safe from interrupts.
+    void postpone(Client client, uint32_t time_ms);
+    void run(void);
+
+  private:
+    uint8_t enabled = 1;
+    volatile uint32_t ti_awake_until[CLIENT_COUNT] = {};
+    volatile uint8_t awake_once = 0;  // Bit per client.
+    uint32_t ti_key_activity = 0;
+    bool wake_timer_ready = false;
+
+    uint32_t ti_wake_us = 0;
+    bool woken = false;
+
+    uint32_t sleeps = 0;
+    uint32_t blocked[CLIENT_COUNT] = {};
+    uint64_t sleep_total_us = 0;
+    uint32_t wake_service_max_us = 0;  // From the end of the sleep to the next cycle.
+    uint64_t wake_service_sum_us = 0;
+
+    Client busy_client(void);
+    uint32_t wake_after_ms(void);
+    void sleep(void);
+};
+
+} // namespace plugin
+} // namespace kaleidoscope
+
+extern kaleidoscope::plugin::SleepController SleepController;
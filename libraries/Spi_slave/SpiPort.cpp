@@ -113,6 +113,22 @@ void SpiPort::clearRead() {
 
 }
 
+bool SpiPort::rxPending(void) {
+#if COMPILE_SPI0_SUPPORT
+    if (!spi0_slave.rx_fifo->is_empty()) return true;
+#endif
+
+#if COMPILE_SPI1_SUPPORT
+    if (!spi1_slave.rx_fifo->is_empty()) return true;
+#endif
+
+#if COMPILE_SPI2_SUPPORT
+    if (!spi2_slave.rx_fifo->is_empty()) return true;
+#endif
+
+    return false;
+}
+
 bool SpiPort::readPacket(Packet &packet) {
     if (spi_slave == nullptr) return false;
 
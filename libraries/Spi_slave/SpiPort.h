@@ -117,6 +117,9 @@ class SpiPort
         void clearSend();
         void clearRead();
 
+        // True if a side packet is waiting in the Rx FIFO of any SPI port.
+        static bool rxPending(void);
+
 
        private:
         uint8_t spi_port_used;
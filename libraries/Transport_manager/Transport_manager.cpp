@@ -0,0 +1,206 @@
+/* -*- mode: c++ -*-
+ * kaleidoscope::plugin::TransportManager -- Fail over the host reports between BLE and USB
+ * Copyright (C) 2020  Dygma Lab S.L.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "Transport_manager.h"
+
+#include "Adafruit_USBD_Device.h"
+#include "Ble_composite_dev.h"
+#include "Ble_manager.h"
+#include "Kaleidoscope-EEPROM-Settings.h"
+#include "Kaleidoscope-FocusSerial.h"
+#include "hidDefy.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "nrf_power.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+namespace kaleidoscope
+{
+namespace plugin
+{
+
+#define TRANSPORT_FAILOVER_MS       1000  // BLE down for this long before moving to USB.
+#define TRANSPORT_FAILBACK_MS       2000  // BLE up for this long before moving back to it.
+#define TRANSPORT_ATTACH_TIMEOUT_MS 3000  // Max wait for the USB host to enumerate the device.
+#define TRANSPORT_ATTACH_BACKOFF_MS 30000 // Wait after a USB host that did not enumerate the device.
+
+void TransportManager::reserve_settings(void)
+{
+    settings_base_ = kaleidoscope::plugin::EEPROMSettings::requestSlice(sizeof(failover_enabled));
+    Runtime.storage().get(settings_base_, failover_enabled);
+    if (failover_enabled == 0xFF)
+    {
+        failover_enabled = 0;
+        Runtime.storage().put(settings_base_, failover_enabled);
+        Runtime.storage().commit();
+    }
+}
+
+bool TransportManager::vbus_present(void)
+{
+    return nrf_power_usbregstatus_vbusdet_get();
+}
+
+void TransportManager::to_ble(void)
+{
+    HID().switchHostPath(HOST_PATH_AUTO);
+    TinyUSBDevice.detach();
+    state = STATE_BLE;
+}
+
+EventHandlerResult TransportManager::beforeEachCycle()
+{
+    // In wired mode the BLE stack is not running and USB is the only host path.
+    if (!ble_innited()) return EventHandlerResult::OK;
+
+    bool connected = ble_connected();
+
+    if (!connected && !ble_lost)
+    {
+        ble_lost = true;
+        ti_ble_lost = Runtime.millisAtCycleStart();
+    }
+    else if (connected)
+    {
+        ble_lost = false;
+    }
+
+    if (connected && !ble_back)
+    {
+        ble_back = true;
+        ti_ble_back = Runtime.millisAtCycleStart();
+    }
+    else if (!connected)
+    {
+        ble_back = false;
+    }
+
+    // A new BLE link or a new USB supply gives the USB host another chance.
+    if (connected || !vbus_present())
+    {
+        attach_failed = false;
+    }
+
+    switch (state)
+    {
+        case STATE_BLE:
+            // No failover while the user is pairing a host, only when a bonded host is lost.
+            if (!failover_enabled || !ble_lost || ::BleManager.isPairing() || !vbus_present()) break;
+            if (!Runtime.hasTimeExpired(ti_ble_lost, static_cast<uint32_t>(TRANSPORT_FAILOVER_MS))) break;
+            if (attach_failed && !Runtime.hasTimeExpired(ti_attach, static_cast<uint32_t>(TRANSPORT_ATTACH_TIMEOUT_MS + TRANSPORT_ATTACH_BACKOFF_MS))) break;
+
+            TinyUSBDevice.attach();
+            ti_attach = Runtime.millisAtCycleStart();
+            state = STATE_USB_ATTACHING;
+            break;
+
+        case STATE_USB_ATTACHING:
+            if (connected || !vbus_present())
+            {
+                TinyUSBDevice.detach();
+                state = STATE_BLE;
+                break;
+            }
+
+            if (Runtime.hasTimeExpired(ti_attach, static_cast<uint32_t>(TRANSPORT_ATTACH_TIMEOUT_MS)))
+            {
+                // Powered but not enumerated, likely a charger. Retrying every cycle would flap the USB device.
+                TinyUSBDevice.detach();
+                attach_failed = true;
+                state = STATE_BLE;
+
+                NRF_LOG_INFO("Transport_manager: USB host did not enumerate the device.");
+                break;
+            }
+
+            if (!TinyUSBDevice.mounted()) break;
+
+            HID().switchHostPath(HOST_PATH_USB);
+            state = STATE_USB;
+            failovers++;
+            gap_last_ms = Runtime.millisAtCycleStart() - ti_ble_lost;
+            if (gap_last_ms > gap_max_ms) gap_max_ms = gap_last_ms;
+
+            NRF_LOG_INFO("Transport_manager: BLE lost, reports go through USB after %lu ms.", gap_last_ms);
+            break;
+
+        case STATE_USB:
+            if (!vbus_present() || !failover_enabled)
+            {
+                to_ble();
+                break;
+            }
+
+            if (ble_back && Runtime.hasTimeExpired(ti_ble_back, static_cast<uint32_t>(TRANSPORT_FAILBACK_MS)))
+            {
+                to_ble();
+                failbacks++;
+
+                NRF_LOG_INFO("Transport_manager: back to BLE.");
+            }
+            break;
+    }
+
+    return EventHandlerResult::OK;
+}
+
+EventHandlerResult TransportManager::onFocusEvent(const char *command)
+{
+    if (::Focus.handleHelp(command, "transport.failover\ntransport.stats")) return EventHandlerResult::OK;
+
+    if (strncmp(command, "transport.", 10) != 0) return EventHandlerResult::OK;
+
+    if (strcmp(command + 10, "failover") == 0)
+    {
+        if (::Focus.isEOL())
+        {
+            ::Focus.send(failover_enabled);
+        }
+        else
+        {
+            uint8_t enabled;
+            ::Focus.read(enabled);
+            failover_enabled = enabled ? 1 : 0;
+            Runtime.storage().put(settings_base_, failover_enabled);
+            Runtime.storage().commit();
+        }
+    }
+
+    // Host path (0 BLE, 1 attaching USB, 2 USB), failovers, failbacks, last and max switchover gap in ms.
+    if (strcmp(command + 10, "stats") == 0)
+    {
+        if (::Focus.isEOL())
+        {
+            ::Focus.send(static_cast<uint8_t>(state), failovers, failbacks, gap_last_ms, gap_max_ms);
+        }
+    }
+
+    return EventHandlerResult::EVENT_CONSUMED;
+}
+
+} // namespace plugin
+} // namespace kaleidoscope
+
+kaleidoscope::plugin::TransportManager TransportManager;
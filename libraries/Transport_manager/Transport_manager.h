@@ -0,0 +1,78 @@
+/* -*- mode: c++ -*-
+ * kaleidoscope::plugin::TransportManager -- Fail over the host reports between BLE and USB
+ * Copyright (C) 2020  Dygma Lab S.L.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "kaleidoscope/Runtime.h"
+#include "kaleidoscope/plugin.h"
+#include <Arduino.h>
+
+namespace kaleidoscope
+{
+namespace plugin
+{
+
+/*
+    In BLE mode the USB device is detached. When the BLE host is lost while a USB host is
+    powering the keyboard, the USB device is attached again and the HID reports go through it
+    until BLE is back, without resetting the MCU. The held keys move with the reports (see
+    HID_::switchHostPath()). Disabled by default: with a charger-only PC the keys would end up
+    in the wrong host. A USB supply that does not enumerate the device is tried again only after
+    TRANSPORT_ATTACH_BACKOFF_MS, a new BLE link or a replug.
+*/
+class TransportManager : public Plugin
+{
+  public:
+    EventHandlerResult beforeEachCycle();
+    EventHandlerResult onFocusEvent(const char *command);
+
+    // Requests the failover slice, from setup() after BleManager.reserve_settings().
+    void reserve_settings(void);
+
+  private:
+    enum State : uint8_t
+    {
+        STATE_BLE,
+        STATE_USB_ATTACHING,
+        STATE_USB,
+    };
+
+    State state = STATE_BLE;
+    uint8_t failover_enabled = 0;
+    uint16_t settings_base_ = 0;
+
+    uint32_t ti_ble_lost = 0;
+    bool ble_lost = false;
+    uint32_t ti_ble_back = 0;
+    bool ble_back = false;
+    uint32_t ti_attach = 0;
+    bool attach_failed = false;  // The last USB host did not enumerate the device, it may be a charger.
+
+    uint16_t failovers = 0;
+    uint16_t failbacks = 0;
+    uint32_t gap_last_ms = 0;  // From the BLE link loss to the reports going through USB.
+    uint32_t gap_max_ms = 0;
+
+    bool vbus_present(void);
+    void to_ble(void);
+};
+
+} // namespace plugin
+} // namespace kaleidoscope
+
+extern kaleidoscope::plugin::TransportManager TransportManager;
@@ -1,6 +1,7 @@
 
 #include "Arduino.h"
 #include "nrf_drv_clock.h"
+#include "hfclk_arbiter.h"
 #include "rf_host_device_api.h"
 
 void rfhdev_api_init(void)
@@ -8,8 +9,8 @@ void rfhdev_api_init(void)
     result_t result = RESULT_ERR;
     rfhdev_config_t rfhdev_config;
 
-    rfhdev_config.clock_hfclk_start_cb = nrfx_clock_hfclk_start;
-    rfhdev_config.clock_hfclk_stop_cb = nrfx_clock_hfclk_stop;
+    rfhdev_config.clock_hfclk_start_cb = hfclk_arbiter_rf_start;
+    rfhdev_config.clock_hfclk_stop_cb = hfclk_arbiter_rf_stop;
     rfhdev_config.ppi_channel_alloc_cb = nrfx_ppi_channel_alloc;
     rfhdev_config.sleep_postpone_cb = NULL;
     rfhdev_config.millis_request_cb = millis;
@@ -79,7 +79,12 @@ extern "C"
 #include "Battery.h"
 #include "Ble_manager.h"
 #include "Communications.h"
+#include "Flash_arbiter.h"
+#include "Hfclk_arbiter.h"
+#include "Power_governor.h"
 #include "Radio_manager.h"
+#include "Sleep_controller.h"
+#include "Transport_manager.h"
 #include "Upgrade.h"
 #include "nrf_fstorage.h"
 #include "rf_host_device_api.h"
@@ -143,10 +148,11 @@ void app_error_fault_handler(uint32_t id, uint32_t pc, uint32_t info)  // On ass
     }
 #endif
 
-    if (EEPROM.getNeedUpdate())
-    {
-        EEPROM.update();
-    }
+    /*
+        Rewriting the whole EEPROM image needs the fstorage events and yield(), which is not safe in
+        a fault context. Only the critical slices are saved, appending them to the emergency journal.
+    */
+    EEPROM.journalCritical();
     NRF_LOG_FINAL_FLUSH();
 
     __disable_irq();
@@ -339,7 +345,7 @@ IdleLEDsDefy, PersistentIdleDefyLEDs, DefyFocus, Qukeys, DynamicMacros,
 /*SideFlash,*/ Focus, MouseKeys, OneShot, LayerFocus,
 HostPowerManagement, Battery,
 /*BLE*/
-RadioManager, BleManager
+RadioManager, BleManager, FlashArbiter, TransportManager, SleepController, HfclkArbiter, PowerGovernor
 );
 // clang-format on
 // End Kaleidoscope
@@ -379,30 +385,45 @@ void setup(void)
     // DefaultColormap.setup();
     DynamicSuperKeys.setup(0, 1024);
     DynamicMacros.reserve_storage(2048);
+
+    // Settings added after the layout above are requested last, so the existing offsets do not move.
+    BleManager.reserve_settings();
+    TransportManager.reserve_settings();
+    PowerGovernor.reserve_settings();
 }
 
 void loop()
 {
     watchdog_timer.reset();
 
+    /*
+        A BLE connection event is about to start. The radio notification has just woken the CPU,
+        so the key changes already received are scanned and queued before the full cycle runs,
+        and the reports go in that event. Only the matrix is scanned, the plugin hooks of the
+        cycle are left for Kaleidoscope.loop().
+    */
+    if (BleManager.anchor_pass_pending())
+    {
+        Communications.run();
+        Kaleidoscope.device().scanMatrix();
+        HID().SendLastReport();
+    }
+
     // Execute Kaleidoscope.
     Kaleidoscope.loop();
     Communications.run();
+
     protocolBreathe();
     EEPROM.timer_update_periodically_run(1000);  // Check if it is necessary to write the eeprom every 1000 ms.
 
-    NRF_LOG_PROCESS(); // Process deferred logs (send it to the host computer via UART).
-
-    /* Control the sleep mode here */
-    /* We need a way of deciding on when we can go to sleep mode and when we should continue. */
-    /* When we have such process, we need to add it to the rf_glue.c mcu_sleep_postpone( ) */
-    // mcu_sleep_control( );
+    // Process deferred logs (send it to the host computer via UART).
+    if (NRF_LOG_PROCESS())
+    {
+        SleepController.postpone(kaleidoscope::plugin::SleepController::CLIENT_LOG, 0);
+    }
 
-    // Even if we miss an event enabling USB, USB event would wake us up.
-    //__WFE();
-    // Clear SEV flag if CPU was woken up by event.
-    //__SEV();
-    //__WFE();
+    // Wait for the next interrupt if nobody needs the CPU.
+    SleepController.run();
 }
 
 
@@ -456,12 +477,16 @@ static void init_gpio(void)
 // Lest implement the reset_mcu so that if we have something to write to the flash is goin to wait for the procedure to finish.
 void reset_mcu(void)
 {
+    // An FDS garbage collection is several fstorage operations, so it is waited for as a whole.
+    FlashArbiter.wait_eeprom();
+
     while (nrf_fstorage_is_busy(NULL))  // Wait until fstorage is available.
     {
         yield();  // Meanwhile execute tasks.
     }
 
-    if (EEPROM.getNeedUpdate())
+    // The full image update is only needed when there are pending changes the journal can not hold.
+    if (EEPROM.getNeedUpdate() && !EEPROM.canJournalPending())
     {
         watchdog_timer.reset();
         EEPROM.update();
@@ -469,6 +494,9 @@ void reset_mcu(void)
 
     sd_softdevice_disable();  // Disable SD.
 
+    // Fast path: append the dirty critical bytes to the journal, they are replayed on the next boot.
+    EEPROM.journalCritical();
+
     // Disable all interrupts
     NVIC->ICER[0] = 0xFFFFFFFF;
     NVIC->ICPR[0] = 0xFFFFFFFF;